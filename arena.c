@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+struct arena_block {
+    struct arena_block* prev;
+    size_t used;
+    size_t cap;
+    char data[];
+};
+
+static const size_t arena_align = 16;
+
+static struct arena_block* new_block(struct arena* a, size_t size);
+static void free_blocks(struct arena_block* b);
+
+void arena_init(struct arena* a, size_t block_size) {
+    a->head = NULL;
+    a->spare = NULL;
+    a->block_size = block_size;
+}
+
+void* arena_alloc(struct arena* a, size_t size) {
+    struct arena_block* b = a->head;
+    if (b != NULL) {
+        uintptr_t p = (uintptr_t)(b->data + b->used);
+        size_t pad = (arena_align - (p & (arena_align - 1))) & (arena_align - 1);
+        if (b->used + pad + size <= b->cap) {
+            b->used += pad + size;
+            return (char*)p + pad;
+        }
+    }
+
+    if ((b = new_block(a, size + arena_align)) == NULL)
+        return NULL;
+
+    uintptr_t p = (uintptr_t)b->data;
+    size_t pad = (arena_align - (p & (arena_align - 1))) & (arena_align - 1);
+    b->used = pad + size;
+    return (char*)p + pad;
+}
+
+char* arena_strndup(struct arena* a, const char* s, size_t len) {
+    char* p = NULL;
+    struct arena_block* b = a->head;
+
+    // strings need no alignment, pack them tightly.
+    if (b != NULL && b->used + len + 1 <= b->cap) {
+        p = b->data + b->used;
+        b->used += len + 1;
+    } else if ((p = arena_alloc(a, len + 1)) == NULL) {
+        return NULL;
+    }
+
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+struct arena_mark arena_mark(struct arena* a) {
+    struct arena_mark m;
+    m.block = a->head;
+    m.used = a->head != NULL ? a->head->used : 0;
+    return m;
+}
+
+void arena_release(struct arena* a, struct arena_mark m) {
+    while (a->head != m.block) {
+        struct arena_block* b = a->head;
+        a->head = b->prev;
+
+        if (b->cap == a->block_size && a->spare == NULL) {
+            b->prev = NULL;
+            a->spare = b;
+        } else {
+            free(b);
+        }
+    }
+
+    if (a->head != NULL)
+        a->head->used = m.used;
+}
+
+void arena_free(struct arena* a) {
+    free_blocks(a->head);
+    free_blocks(a->spare);
+    a->head = NULL;
+    a->spare = NULL;
+}
+
+static struct arena_block* new_block(struct arena* a, size_t size) {
+    struct arena_block* b = NULL;
+
+    if (size <= a->block_size && a->spare != NULL) {
+        b = a->spare;
+        a->spare = NULL;
+    } else {
+        size_t cap = size > a->block_size ? size : a->block_size;
+        if ((b = malloc(sizeof(struct arena_block) + cap)) == NULL) {
+            fprintf(stderr, "malloc, no memory\n");
+            return NULL;
+        }
+        b->cap = cap;
+    }
+
+    b->used = 0;
+    b->prev = a->head;
+    a->head = b;
+    return b;
+}
+
+static void free_blocks(struct arena_block* b) {
+    while (b != NULL) {
+        struct arena_block* prev = b->prev;
+        free(b);
+        b = prev;
+    }
+}
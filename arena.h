@@ -0,0 +1,27 @@
+#include <stddef.h>
+
+/*
+ * arena is a bump allocator. Memory is carved from large blocks and is given
+ * back all at once, either completely (arena_free) or up to a previously
+ * taken mark (arena_release). Pointers stay valid until then.
+ */
+struct arena_block;
+
+struct arena {
+    struct arena_block* head;  /* the block allocations are carved from */
+    struct arena_block* spare; /* released blocks kept for reuse */
+    size_t block_size;
+};
+
+struct arena_mark {
+    struct arena_block* block;
+    size_t used;
+};
+
+void arena_init(struct arena* a, size_t block_size);
+void* arena_alloc(struct arena* a, size_t size);
+char* arena_strndup(struct arena* a, const char* s, size_t len);
+
+struct arena_mark arena_mark(struct arena* a);
+void arena_release(struct arena* a, struct arena_mark m);
+void arena_free(struct arena* a);
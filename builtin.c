@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "builtin.h"
+#include "counter.h"
+#include "reader.h"
+
+/*
+ * opts walks the options of an argument list like getopt does, but keeps its
+ * state here instead of optind, so builtins can parse their arguments in
+ * several threads at once.
+ */
+struct opts {
+    char** av;
+    int ind;    /* the argument to look at next */
+    char* next; /* the rest of a group of options, e.g. "wc" of "-lwc" */
+    char* arg;  /* the argument of the last option */
+};
+
+typedef int (*core)(FILE* in, FILE* out, int num);
+
+static void opts_init(struct opts* o, char** av);
+static int opts_next(struct opts* o, const char* spec);
+
+static int each_file(char** files, int headers, FILE* in, FILE* out, core fn, int num);
+static int tail_any(FILE* in, FILE* out, int nlines);
+static int count(FILE* f, const char* name, unsigned what, FILE* out);
+
+static int run_cat(char** av, FILE* in, FILE* out);
+static int run_head(char** av, FILE* in, FILE* out);
+static int run_tail(char** av, FILE* in, FILE* out);
+static int run_pwc(char** av, FILE* in, FILE* out);
+
+static const struct builtin builtins[] = {
+    { "cat", "qn", run_cat },
+    { "head", "qn:", run_head },
+    { "tail", "qn:", run_tail },
+    { "pwc", "lwcmL", run_pwc },
+};
+
+const struct builtin* builtin_find(char** av) {
+    const struct builtin* b = NULL;
+    struct opts o;
+
+    if (av[0] == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(av[0], builtins[i].name) == 0)
+            b = &builtins[i];
+    }
+    if (b == NULL)
+        return NULL;
+
+    // anything else is left to the real tool, e.g. head -c or pwc -j.
+    opts_init(&o, av);
+    for (int c = 0; (c = opts_next(&o, b->opts)) != -1;) {
+        if (c == '?')
+            return NULL;
+    }
+
+    return b;
+}
+
+static int run_cat(char** av, FILE* in, FILE* out) {
+    int suppress_file_name = 0;
+    int is_print_num = 0;
+    struct opts o;
+
+    opts_init(&o, av);
+    for (int c = 0; (c = opts_next(&o, "qn")) != -1;) {
+        if (c == 'q')
+            suppress_file_name = 1;
+        else if (c == 'n')
+            is_print_num = 1;
+    }
+
+    char** files = av + o.ind;
+    const int headers = files[0] != NULL && files[1] != NULL && !suppress_file_name;
+    return each_file(files, headers, in, out, cat_lines, is_print_num);
+}
+
+static int run_head(char** av, FILE* in, FILE* out) {
+    int suppress_file_name = 0;
+    int nlines = 10;
+    struct opts o;
+
+    opts_init(&o, av);
+    for (int c = 0; (c = opts_next(&o, "qn:")) != -1;) {
+        if (c == 'q')
+            suppress_file_name = 1;
+        else if (c == 'n' && parse_num(o.arg, &nlines) == -1)
+            return EXIT_FAILURE;
+    }
+
+    char** files = av + o.ind;
+    const int headers = files[0] != NULL && files[1] != NULL && !suppress_file_name;
+    return each_file(files, headers, in, out, head_lines, nlines);
+}
+
+static int run_tail(char** av, FILE* in, FILE* out) {
+    int suppress_file_name = 0;
+    int nlines = 10;
+    struct opts o;
+
+    opts_init(&o, av);
+    for (int c = 0; (c = opts_next(&o, "qn:")) != -1;) {
+        if (c == 'q')
+            suppress_file_name = 1;
+        else if (c == 'n' && parse_num(o.arg, &nlines) == -1)
+            return EXIT_FAILURE;
+    }
+
+    char** files = av + o.ind;
+    const int headers = files[0] != NULL && files[1] != NULL && !suppress_file_name;
+    return each_file(files, headers, in, out, tail_any, nlines);
+}
+
+static int run_pwc(char** av, FILE* in, FILE* out) {
+    unsigned what = 0;
+    int status = EXIT_SUCCESS;
+    struct opts o;
+
+    opts_init(&o, av);
+    for (int c = 0; (c = opts_next(&o, "lwcmL")) != -1;) {
+        if (c == 'l')
+            what |= WC_LINES;
+        else if (c == 'w')
+            what |= WC_WORDS;
+        else if (c == 'c')
+            what |= WC_BYTES;
+        else if (c == 'm')
+            what |= WC_CHARS;
+        else if (c == 'L')
+            what |= WC_MAXLEN;
+    }
+
+    if (what == 0)
+        what = WC_LINES | WC_WORDS | WC_BYTES;
+
+    if (av[o.ind] == NULL)
+        return count(in, NULL, what, out) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    for (char** fp = av + o.ind; *fp != NULL && !reader_cancel; fp++) {
+        FILE* f = fopen(*fp, "r");
+        if (f == NULL) {
+            fprintf(stderr, "fopen(%s): %s\n", *fp, strerror(errno));
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        if (count(f, *fp, what, out) == -1)
+            status = EXIT_FAILURE;
+
+        if (fclose(f) == EOF) {
+            fprintf(stderr, "fclose(%s): %s\n", *fp, strerror(errno));
+            status = EXIT_FAILURE;
+        }
+    }
+
+    return status;
+}
+
+/*
+ * each_file runs @fn over every file of the NULL terminated @files, or over
+ * @in if there are none. A file is preceded by a header if @headers is set,
+ * the same way read_files does it.
+ */
+static int each_file(char** files, int headers, FILE* in, FILE* out, core fn, int num) {
+    if (files[0] == NULL)
+        return fn(in, out, num) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    for (char** fp = files; *fp != NULL; fp++) {
+        FILE* f = fopen(*fp, "r");
+        if (f == NULL) {
+            fprintf(stderr, "fopen(%s): %s\n", *fp, strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        if (headers)
+            fprintf(out, "%s==> %s <==\n", fp == files ? "" : "\n", *fp);
+
+        const int ret = fn(f, out, num);
+        if (fclose(f) == EOF) {
+            fprintf(stderr, "fclose(%s): %s\n", *fp, strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        if (ret == -1)
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* tail_any is tail_lines for any stream, a pipe is spooled to a file first. */
+static int tail_any(FILE* in, FILE* out, int nlines) {
+    if (fseek(in, 0, SEEK_CUR) == 0)
+        return tail_lines(in, out, nlines);
+
+    FILE* tmp = spool(in);
+    if (tmp == NULL)
+        return -1;
+
+    const int ret = tail_lines(tmp, out, nlines);
+    if (fclose(tmp) == EOF) {
+        perror("fclose");
+        return -1;
+    }
+
+    return ret;
+}
+
+static int count(FILE* f, const char* name, unsigned what, FILE* out) {
+    char buf[BUFSIZ * 16];
+    struct wc_counts c;
+    size_t n = 0;
+
+    wc_init(&c);
+    while (!reader_cancel && (n = fread(buf, 1, sizeof(buf), f)) > 0)
+        wc_count_as(what, &c, buf, n);
+
+    if (ferror(f) != 0) {
+        if (errno != EINTR)
+            fprintf(stderr, "fread(%s): %s\n", name ? name : "stdin", strerror(errno));
+        return -1;
+    }
+    if (reader_cancel)
+        return -1;
+
+    wc_print(out, what, &c, name);
+    return 0;
+}
+
+static void opts_init(struct opts* o, char** av) {
+    o->av = av;
+    o->ind = 1;
+    o->next = NULL;
+    o->arg = NULL;
+}
+
+/*
+ * opts_next returns the next option of @spec (getopt syntax), '?' for an
+ * unknown option or a missing argument and -1 after the last option.
+ */
+static int opts_next(struct opts* o, const char* spec) {
+    if (o->next == NULL || *o->next == '\0') {
+        char* a = o->av[o->ind];
+        if (a == NULL || a[0] != '-' || a[1] == '\0')
+            return -1;
+
+        o->ind++;
+        if (strcmp(a, "--") == 0)
+            return -1;
+        o->next = a + 1;
+    }
+
+    const int c = *o->next++;
+    const char* s = strchr(spec, c);
+    if (c == ':' || s == NULL)
+        return '?';
+
+    if (s[1] == ':') {
+        if (*o->next != '\0')
+            o->arg = o->next;
+        else if (o->av[o->ind] != NULL)
+            o->arg = o->av[o->ind++];
+        else
+            return '?';
+        o->next = NULL;
+    }
+
+    return c;
+}
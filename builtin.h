@@ -0,0 +1,20 @@
+#include <stdio.h>
+
+/*
+ * builtin is one of the project's tools that sh runs inside its own process:
+ * cat, head -n, tail -n and pwc. @run reads @in and writes @out (the files of
+ * @av if there are any), it must not touch any global state, several builtins
+ * of a pipeline run in parallel threads. It stops early once reader_cancel
+ * of its thread is set. Returns the exit status.
+ */
+struct builtin {
+    const char* name;
+    const char* opts; /* the options the builtin supports, getopt syntax */
+    int (*run)(char** av, FILE* in, FILE* out);
+};
+
+/*
+ * builtin_find returns the builtin of the @av command, or NULL if it isn't a
+ * builtin or has options only the real tool knows.
+ */
+const struct builtin* builtin_find(char** av);
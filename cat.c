@@ -46,36 +46,5 @@ int main(int ac, char* av[]) {
 }
 
 static int read_cat(FILE* f) {
-    int ln = 1;
-    int is_new_line = 1;
-
-    int c = 0;
-    for (;;) {
-        c = getc(f);
-        if (ferror(f) != 0) {
-            perror("getc");
-            return -1;
-        }
-
-        if (feof(f))
-            break;
-
-        if (is_new_line) {
-            if (is_print_num) {
-                printf("  %d  ", ln);
-                ln++;
-                is_new_line = 0;
-            }
-        }
-
-        if (putchar(c) == EOF) {
-            perror("putchar");
-            return -1;
-        }
-
-        if (c == '\n')
-            is_new_line = 1;
-    }
-
-    return 0;
+    return cat_lines(f, stdout, is_print_num);
 }
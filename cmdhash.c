@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cmdhash.h"
+#include "hash.h"
+
+/* the search path execvp uses when $PATH isn't set */
+static const char DEFAULT_PATH[] = "/bin:/usr/bin";
+
+static struct cmd_hash_entry* lookup(const struct cmd_hash* h, const char* name);
+static int grow(struct cmd_hash* h);
+static int sync_env(struct cmd_hash* h);
+static char* search(const char* env, const char* name);
+
+const char* cmd_hash_lookup(struct cmd_hash* h, const char* name) {
+    struct cmd_hash_entry* e = NULL;
+    char* path = NULL;
+
+    if (strchr(name, '/') != NULL)
+        return name;
+
+    if (sync_env(h) == -1)
+        return NULL;
+
+    if (h->len != 0 && (e = lookup(h, name))->name != NULL) {
+        e->hits++;
+        return e->path;
+    }
+
+    if ((path = search(h->env, name)) == NULL)
+        return NULL;
+
+    if (hash_full(h->len, h->cap) && grow(h) == -1)
+        goto error;
+
+    e = lookup(h, name);
+    if ((e->name = strdup(name)) == NULL) {
+        fprintf(stderr, "strdup, no memory\n");
+        goto error;
+    }
+    e->path = path;
+    e->hits = 1;
+    h->len++;
+    return e->path;
+
+error:
+    free(path);
+    errno = ENOMEM;
+    return NULL;
+}
+
+void cmd_hash_forget(struct cmd_hash* h, const char* name) {
+    if (h->len == 0)
+        return;
+
+    struct cmd_hash_entry* e = lookup(h, name);
+    if (e->name == NULL)
+        return;
+
+    free(e->name);
+    free(e->path);
+    e->name = NULL;
+    h->len--;
+
+    // the entries after the hole might have probed past it, put them again.
+    size_t i = hash_next(e - h->slots, h->cap);
+    while (h->slots[i].name != NULL) {
+        struct cmd_hash_entry moved = h->slots[i];
+        h->slots[i].name = NULL;
+        *lookup(h, moved.name) = moved;
+        i = hash_next(i, h->cap);
+    }
+}
+
+void cmd_hash_print(const struct cmd_hash* h, FILE* f) {
+    if (h->len == 0) {
+        fprintf(f, "hash: hash table empty\n");
+        return;
+    }
+
+    fprintf(f, "hits\tcommand\n");
+    for (size_t i = 0; i < h->cap; i++) {
+        if (h->slots[i].name != NULL)
+            fprintf(f, "%4u\t%s\n", h->slots[i].hits, h->slots[i].path);
+    }
+}
+
+void cmd_hash_free(struct cmd_hash* h) {
+    for (size_t i = 0; i < h->cap; i++) {
+        free(h->slots[i].name);
+        free(h->slots[i].path);
+    }
+    free(h->slots);
+    free(h->env);
+    memset(h, 0, sizeof(*h));
+}
+
+/*
+ * lookup returns the slot of the @name entry or the empty slot where it
+ * would be placed. The table must have at least one empty slot.
+ */
+static struct cmd_hash_entry* lookup(const struct cmd_hash* h, const char* name) {
+    size_t i = hash_slot(fnv1a(FNV1A_INIT, name, strlen(name)), h->cap);
+
+    for (;;) {
+        struct cmd_hash_entry* e = &h->slots[i];
+        if (e->name == NULL || strcmp(e->name, name) == 0)
+            return e;
+        i = hash_next(i, h->cap);
+    }
+}
+
+static int grow(struct cmd_hash* h) {
+    struct cmd_hash old = *h;
+
+    h->cap = old.cap == 0 ? 64 : old.cap * 2;
+    if ((h->slots = calloc(h->cap, sizeof(struct cmd_hash_entry))) == NULL) {
+        fprintf(stderr, "calloc, no memory\n");
+        *h = old;
+        return -1;
+    }
+
+    for (size_t i = 0; i < old.cap; i++) {
+        if (old.slots[i].name != NULL)
+            *lookup(h, old.slots[i].name) = old.slots[i];
+    }
+
+    free(old.slots);
+    return 0;
+}
+
+/* sync_env empties @h if $PATH isn't the one its entries were found in. */
+static int sync_env(struct cmd_hash* h) {
+    const char* env = getenv("PATH");
+    if (env == NULL)
+        env = DEFAULT_PATH;
+
+    if (h->env != NULL && strcmp(h->env, env) == 0)
+        return 0;
+
+    cmd_hash_free(h);
+    if ((h->env = strdup(env)) == NULL) {
+        fprintf(stderr, "strdup, no memory\n");
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * search returns the first executable @name in the directories of @env, an
+ * empty one stands for the current directory. Returns NULL with errno set to
+ * ENOENT if there is none.
+ */
+static char* search(const char* env, const char* name) {
+    char buf[PATH_MAX];
+    struct stat st;
+    const char* dir = env;
+
+    for (;;) {
+        const char* end = strchrnul(dir, ':');
+        int len = 0;
+
+        if (end == dir)
+            len = snprintf(buf, sizeof(buf), "./%s", name);
+        else
+            len = snprintf(buf, sizeof(buf), "%.*s/%s", (int)(end - dir), dir, name);
+
+        if ((size_t)len < sizeof(buf) && stat(buf, &st) == 0 && S_ISREG(st.st_mode)
+            && access(buf, X_OK) == 0) {
+            char* path = strdup(buf);
+            if (path == NULL) {
+                fprintf(stderr, "strdup, no memory\n");
+                errno = ENOMEM;
+            }
+            return path;
+        }
+
+        if (*end == '\0')
+            break;
+        dir = end + 1;
+    }
+
+    errno = ENOENT;
+    return NULL;
+}
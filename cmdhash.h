@@ -0,0 +1,34 @@
+#include <stdio.h>
+
+/*
+ * cmd_hash remembers where in $PATH the commands were found, like the hash
+ * builtin of bash. A command is looked up once, later launches exec the
+ * remembered path directly. The table is emptied when $PATH changes.
+ */
+struct cmd_hash_entry {
+    char* name; /* NULL - an empty slot */
+    char* path;
+    unsigned hits;
+};
+
+/* cmd_hash is an open addressing hash table of entries */
+struct cmd_hash {
+    struct cmd_hash_entry* slots;
+    size_t cap;
+    size_t len;
+    char* env; /* $PATH the entries were found in */
+};
+
+/*
+ * cmd_hash_lookup returns the path of the @name command, searching $PATH if
+ * it isn't remembered yet. A @name with a slash is returned as is. Returns
+ * NULL with errno set to ENOENT if there is no such command, or in case of
+ * the error.
+ */
+const char* cmd_hash_lookup(struct cmd_hash* h, const char* name);
+
+/* cmd_hash_forget drops @name, e.g. when its remembered path is gone. */
+void cmd_hash_forget(struct cmd_hash* h, const char* name);
+
+void cmd_hash_print(const struct cmd_hash* h, FILE* f);
+void cmd_hash_free(struct cmd_hash* h);
@@ -0,0 +1,463 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "counter.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WC_X86 1
+#include <immintrin.h>
+#endif
+
+#ifdef __GNUC__
+#define WC_INLINE static inline __attribute__((always_inline))
+#else
+#define WC_INLINE static inline
+#endif
+
+/*
+ * Every combination of the metrics has its own kernel: the generic kernels
+ * below take the WC_* flags as a compile time constant, so an instance
+ * contains only the work for its metrics. Kernels are indexed by the flags
+ * without WC_BYTES, bytes are counted for free.
+ */
+enum { NKERNELS = WC_BYTES };
+
+typedef void (*wc_kernel)(struct wc_counts* c, const unsigned char* p, size_t len);
+
+static wc_kernel kernel = NULL;
+
+static const unsigned char is_space[256] = {
+    ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1, [' '] = 1,
+};
+
+/*
+ * char_width is the display width of the character @wc as wcwidth of the
+ * current locale tells, a non-printable one takes no room the same as in
+ * wc(1). Without a UTF-8 locale only ASCII is printable.
+ */
+static int char_width(unsigned wc) {
+    const int w = wcwidth((wchar_t)wc);
+    return w > 0 ? w : 0;
+}
+
+WC_INLINE void
+scalar_generic(unsigned what, struct wc_counts* c, const unsigned char* p, size_t len) {
+    uintmax_t lines = 0;
+    uintmax_t words = 0;
+    uintmax_t chars = 0;
+    uintmax_t col = c->col;
+    uintmax_t maxlen = c->maxlen;
+    unsigned wc = c->wc;
+    int wc_need = c->wc_need;
+    int in_word = c->in_word;
+
+    size_t i = 0;
+    for (; i < len; i++) {
+        const unsigned char ch = p[i];
+
+        if (what & WC_LINES)
+            lines += ch == '\n';
+
+        if (what & WC_WORDS) {
+            const int space = is_space[ch];
+            words += !space & !in_word;
+            in_word = !space;
+        }
+
+        if (what & WC_CHARS)
+            chars += (ch & 0xc0) != 0x80;
+
+        // the UTF-8 characters are decoded for their width, a broken
+        // sequence is dropped.
+        if (what & WC_MAXLEN) {
+            if (ch == '\n' || ch == '\r' || ch == '\f') {
+                if (col > maxlen)
+                    maxlen = col;
+                col = 0;
+                wc_need = 0;
+            } else if (ch == '\t') {
+                col = (col + 8) & ~(uintmax_t)7;
+                wc_need = 0;
+            } else if (ch < 0x80) {
+                col += ch >= 0x20 && ch < 0x7f;
+                wc_need = 0;
+            } else if ((ch & 0xc0) == 0x80) {
+                if (wc_need > 0) {
+                    wc = wc << 6 | (ch & 0x3f);
+                    if (--wc_need == 0)
+                        col += char_width(wc);
+                }
+            } else {
+                wc_need = ch >= 0xf0 ? 3 : ch >= 0xe0 ? 2 : 1;
+                wc = ch & (0x3f >> wc_need);
+            }
+        }
+    }
+
+    if (col > maxlen)
+        maxlen = col;
+
+    c->lines += lines;
+    c->words += words;
+    c->chars += chars;
+    c->col = col;
+    c->maxlen = maxlen;
+    c->wc = wc;
+    c->wc_need = wc_need;
+    c->in_word = in_word;
+}
+
+#define SCALAR_KERNEL(what)                                                           \
+    static void scalar_##what(struct wc_counts* c, const unsigned char* p, size_t len) { \
+        scalar_generic(what, c, p, len);                                              \
+    }
+
+SCALAR_KERNEL(0)
+SCALAR_KERNEL(1)
+SCALAR_KERNEL(2)
+SCALAR_KERNEL(3)
+SCALAR_KERNEL(4)
+SCALAR_KERNEL(5)
+SCALAR_KERNEL(6)
+SCALAR_KERNEL(7)
+SCALAR_KERNEL(8)
+SCALAR_KERNEL(9)
+SCALAR_KERNEL(10)
+SCALAR_KERNEL(11)
+SCALAR_KERNEL(12)
+SCALAR_KERNEL(13)
+SCALAR_KERNEL(14)
+SCALAR_KERNEL(15)
+
+static const wc_kernel scalar_kernels[NKERNELS] = {
+    scalar_0, scalar_1, scalar_2,  scalar_3,  scalar_4,  scalar_5,  scalar_6,  scalar_7,
+    scalar_8, scalar_9, scalar_10, scalar_11, scalar_12, scalar_13, scalar_14, scalar_15,
+};
+
+#ifdef WC_X86
+/*
+ * The vector kernels handle 64 bytes at a time. They build one bit per byte
+ * masks: newlines, white space and UTF-8 continuation bytes. A word starts at
+ * a non-space byte whose predecessor is a space, the top bit of the space
+ * mask is carried to the next block. The tail shorter than 64 bytes is
+ * counted by the scalar kernel. The longest line needs the position of
+ * every tab, kernels with WC_MAXLEN are always scalar.
+ *
+ * The lines-only kernels skip the masks: they sum the compare results in
+ * byte lanes and fold the lanes with psadbw before they can overflow.
+ */
+
+__attribute__((target("sse2"))) WC_INLINE void
+sse2_generic(unsigned what, struct wc_counts* c, const unsigned char* p, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4); /* '\t'..'\r' */
+    const __m128i top2 = _mm_set1_epi8((char)0xc0);
+    const __m128i cont = _mm_set1_epi8((char)0x80);
+
+    uintmax_t lines = 0;
+    uintmax_t words = 0;
+    uintmax_t chars = 0;
+    uint64_t prev_space = !c->in_word;
+
+    for (; len >= 64; p += 64, len -= 64) {
+        uint64_t nls = 0;
+        uint64_t sps = 0;
+        uint64_t conts = 0;
+
+        int i = 0;
+        for (; i < 4; i++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(p + i * 16));
+
+            if (what & WC_LINES) {
+                __m128i m = _mm_cmpeq_epi8(v, nl);
+                nls |= (uint64_t)(uint16_t)_mm_movemask_epi8(m) << (i * 16);
+            }
+
+            if (what & WC_WORDS) {
+                __m128i t = _mm_sub_epi8(v, tab);
+                __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(t, four), t);
+                __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, sp), ctl);
+                sps |= (uint64_t)(uint16_t)_mm_movemask_epi8(ws) << (i * 16);
+            }
+
+            if (what & WC_CHARS) {
+                __m128i m = _mm_cmpeq_epi8(_mm_and_si128(v, top2), cont);
+                conts |= (uint64_t)(uint16_t)_mm_movemask_epi8(m) << (i * 16);
+            }
+        }
+
+        if (what & WC_LINES)
+            lines += __builtin_popcountll(nls);
+
+        if (what & WC_WORDS) {
+            words += __builtin_popcountll(~sps & ((sps << 1) | prev_space));
+            prev_space = sps >> 63;
+        }
+
+        if (what & WC_CHARS)
+            chars += 64 - __builtin_popcountll(conts);
+    }
+
+    c->lines += lines;
+    c->words += words;
+    c->chars += chars;
+    if (what & WC_WORDS)
+        c->in_word = !prev_space;
+
+    scalar_generic(what, c, p, len);
+}
+
+__attribute__((target("sse2"))) static void
+sse2_lines(struct wc_counts* c, const unsigned char* p, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    uintmax_t lines = 0;
+
+    while (len >= 64) {
+        // a round adds at most 4 to a lane, fold the lanes before 255.
+        size_t rounds = len / 64 > 63 ? 63 : len / 64;
+        __m128i acc = zero;
+
+        for (; rounds > 0; rounds--, p += 64, len -= 64) {
+            __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), nl);
+            __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), nl);
+            __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), nl);
+            __m128i e = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 48)), nl);
+            acc = _mm_sub_epi8(acc, _mm_add_epi8(_mm_add_epi8(a, b), _mm_add_epi8(d, e)));
+        }
+
+        uint64_t sums[2];
+        _mm_storeu_si128((__m128i*)sums, _mm_sad_epu8(acc, zero));
+        lines += sums[0] + sums[1];
+    }
+
+    c->lines += lines;
+    scalar_generic(WC_LINES, c, p, len);
+}
+
+__attribute__((target("avx2,popcnt"))) WC_INLINE void
+avx2_generic(unsigned what, struct wc_counts* c, const unsigned char* p, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i four = _mm256_set1_epi8(4); /* '\t'..'\r' */
+    const __m256i top2 = _mm256_set1_epi8((char)0xc0);
+    const __m256i cont = _mm256_set1_epi8((char)0x80);
+
+    uintmax_t lines = 0;
+    uintmax_t words = 0;
+    uintmax_t chars = 0;
+    uint64_t prev_space = !c->in_word;
+
+    for (; len >= 64; p += 64, len -= 64) {
+        uint64_t nls = 0;
+        uint64_t sps = 0;
+        uint64_t conts = 0;
+
+        int i = 0;
+        for (; i < 2; i++) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(p + i * 32));
+
+            if (what & WC_LINES) {
+                __m256i m = _mm256_cmpeq_epi8(v, nl);
+                nls |= (uint64_t)(uint32_t)_mm256_movemask_epi8(m) << (i * 32);
+            }
+
+            if (what & WC_WORDS) {
+                __m256i t = _mm256_sub_epi8(v, tab);
+                __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(t, four), t);
+                __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, sp), ctl);
+                sps |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ws) << (i * 32);
+            }
+
+            if (what & WC_CHARS) {
+                __m256i m = _mm256_cmpeq_epi8(_mm256_and_si256(v, top2), cont);
+                conts |= (uint64_t)(uint32_t)_mm256_movemask_epi8(m) << (i * 32);
+            }
+        }
+
+        if (what & WC_LINES)
+            lines += __builtin_popcountll(nls);
+
+        if (what & WC_WORDS) {
+            words += __builtin_popcountll(~sps & ((sps << 1) | prev_space));
+            prev_space = sps >> 63;
+        }
+
+        if (what & WC_CHARS)
+            chars += 64 - __builtin_popcountll(conts);
+    }
+
+    c->lines += lines;
+    c->words += words;
+    c->chars += chars;
+    if (what & WC_WORDS)
+        c->in_word = !prev_space;
+
+    scalar_generic(what, c, p, len);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_lines(struct wc_counts* c, const unsigned char* p, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    uintmax_t lines = 0;
+
+    while (len >= 128) {
+        // a round adds at most 4 to a lane, fold the lanes before 255.
+        size_t rounds = len / 128 > 63 ? 63 : len / 128;
+        __m256i acc = zero;
+
+        for (; rounds > 0; rounds--, p += 128, len -= 128) {
+            __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), nl);
+            __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 32)), nl);
+            __m256i d = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 64)), nl);
+            __m256i e = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 96)), nl);
+            acc = _mm256_sub_epi8(acc,
+                                  _mm256_add_epi8(_mm256_add_epi8(a, b), _mm256_add_epi8(d, e)));
+        }
+
+        uint64_t sums[4];
+        _mm256_storeu_si256((__m256i*)sums, _mm256_sad_epu8(acc, zero));
+        lines += sums[0] + sums[1] + sums[2] + sums[3];
+    }
+
+    c->lines += lines;
+    scalar_generic(WC_LINES, c, p, len);
+}
+
+#define VECTOR_KERNEL(isa, opts, what)                                              \
+    __attribute__((target(opts))) static void isa##_##what(struct wc_counts* c,      \
+                                                            const unsigned char* p,   \
+                                                            size_t len) {             \
+        isa##_generic(what, c, p, len);                                             \
+    }
+
+VECTOR_KERNEL(sse2, "sse2", 2)
+VECTOR_KERNEL(sse2, "sse2", 3)
+VECTOR_KERNEL(sse2, "sse2", 4)
+VECTOR_KERNEL(sse2, "sse2", 5)
+VECTOR_KERNEL(sse2, "sse2", 6)
+VECTOR_KERNEL(sse2, "sse2", 7)
+
+VECTOR_KERNEL(avx2, "avx2,popcnt", 2)
+VECTOR_KERNEL(avx2, "avx2,popcnt", 3)
+VECTOR_KERNEL(avx2, "avx2,popcnt", 4)
+VECTOR_KERNEL(avx2, "avx2,popcnt", 5)
+VECTOR_KERNEL(avx2, "avx2,popcnt", 6)
+VECTOR_KERNEL(avx2, "avx2,popcnt", 7)
+
+static const wc_kernel sse2_kernels[NKERNELS] = {
+    scalar_0, sse2_lines, sse2_2,    sse2_3,    sse2_4,    sse2_5,    sse2_6,    sse2_7,
+    scalar_8, scalar_9,   scalar_10, scalar_11, scalar_12, scalar_13, scalar_14, scalar_15,
+};
+
+static const wc_kernel avx2_kernels[NKERNELS] = {
+    scalar_0, avx2_lines, avx2_2,    avx2_3,    avx2_4,    avx2_5,    avx2_6,    avx2_7,
+    scalar_8, scalar_9,   scalar_10, scalar_11, scalar_12, scalar_13, scalar_14, scalar_15,
+};
+#endif
+
+static wc_kernel pick(unsigned what) {
+    const wc_kernel* kernels = scalar_kernels;
+
+#ifdef WC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernels = avx2_kernels;
+    else if (__builtin_cpu_supports("sse2"))
+        kernels = sse2_kernels;
+#endif
+
+    return kernels[what & (NKERNELS - 1)];
+}
+
+static void count_with(wc_kernel k, struct wc_counts* c, const char* buf, size_t len) {
+    if (c->bytes == 0 && len > 0)
+        c->head_word = !is_space[(unsigned char)buf[0]];
+
+    k(c, (const unsigned char*)buf, len);
+    c->bytes += len;
+}
+
+void wc_select(unsigned what) {
+    __atomic_store_n(&kernel, pick(what), __ATOMIC_RELAXED);
+}
+
+void wc_init(struct wc_counts* c) {
+    memset(c, 0, sizeof(*c));
+}
+
+void wc_count(struct wc_counts* c, const char* buf, size_t len) {
+    wc_kernel k = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+    if (k == NULL) {
+        wc_select(WC_LINES | WC_WORDS | WC_BYTES);
+        k = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+    }
+
+    count_with(k, c, buf, len);
+}
+
+void wc_count_as(unsigned what, struct wc_counts* c, const char* buf, size_t len) {
+    count_with(pick(what), c, buf, len);
+}
+
+void wc_merge(struct wc_counts* a, const struct wc_counts* b) {
+    if (b->bytes == 0)
+        return;
+
+    if (a->bytes == 0) {
+        *a = *b;
+        return;
+    }
+
+    a->lines += b->lines;
+    a->words += b->words;
+    a->chars += b->chars;
+    a->bytes += b->bytes;
+    if (b->maxlen > a->maxlen)
+        a->maxlen = b->maxlen;
+
+    if (a->in_word && b->head_word)
+        a->words--;
+    a->in_word = b->in_word;
+    a->col = b->col;
+    a->wc = b->wc;
+    a->wc_need = b->wc_need;
+}
+
+void wc_print(FILE* f, unsigned what, const struct wc_counts* c, const char* name) {
+    const char* sep = "";
+
+    if (what & WC_LINES) {
+        fprintf(f, "%s%ju", sep, c->lines);
+        sep = " ";
+    }
+    if (what & WC_WORDS) {
+        fprintf(f, "%s%ju", sep, c->words);
+        sep = " ";
+    }
+    if (what & WC_CHARS) {
+        fprintf(f, "%s%ju", sep, c->chars);
+        sep = " ";
+    }
+    if (what & WC_BYTES) {
+        fprintf(f, "%s%ju", sep, c->bytes);
+        sep = " ";
+    }
+    if (what & WC_MAXLEN) {
+        fprintf(f, "%s%ju", sep, c->maxlen);
+        sep = " ";
+    }
+
+    if (name != NULL)
+        fprintf(f, "%s%s", sep, name);
+    fprintf(f, "\n");
+}
@@ -0,0 +1,65 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* the metrics wc_count can compute, see wc_select */
+enum {
+    WC_LINES = 1 << 0,
+    WC_WORDS = 1 << 1,
+    WC_CHARS = 1 << 2,  /* UTF-8 characters */
+    WC_MAXLEN = 1 << 3, /* the longest line display width */
+    WC_BYTES = 1 << 4,
+};
+
+/*
+ * wc_counts holds the counters of a byte stream and the state that is
+ * carried from one block of the stream to the next one.
+ */
+struct wc_counts {
+    uintmax_t lines;
+    uintmax_t words;
+    uintmax_t chars;
+    uintmax_t bytes;
+    uintmax_t maxlen;
+    uintmax_t col; /* display width of the current line */
+    int in_word;   /* the last counted byte belongs to a word */
+    int head_word; /* the first counted byte belongs to a word */
+    unsigned wc;   /* the bits of a UTF-8 character cut by the block end */
+    int wc_need;   /* number of its continuation bytes still to come */
+};
+
+/*
+ * wc_select picks the counting kernel specialized for the @what metrics (a
+ * set of WC_* flags), it has to be called before any counting starts. Bytes
+ * are always counted. Without a call lines, words and bytes are counted.
+ */
+void wc_select(unsigned what);
+
+void wc_init(struct wc_counts* c);
+
+/*
+ * wc_count adds @len bytes of @buf to @c. A word is a maximal run of bytes
+ * that are not ASCII white space, it may span several calls.
+ */
+void wc_count(struct wc_counts* c, const char* buf, size_t len);
+
+/*
+ * wc_count_as is wc_count with the kernel for the @what metrics instead of the
+ * selected one. Counters that want different metrics can run concurrently.
+ */
+void wc_count_as(unsigned what, struct wc_counts* c, const char* buf, size_t len);
+
+/*
+ * wc_merge appends the counts of the next part of the stream @b to @a, @b has
+ * to be counted from the initial state. A word cut by the parts boundary is
+ * counted once. The longest line can't be merged (a tab width depends on the
+ * line start), streams with WC_MAXLEN have to be counted sequentially.
+ */
+void wc_merge(struct wc_counts* a, const struct wc_counts* b);
+
+/*
+ * wc_print prints the @what metrics of @c to @f in the wc(1) order: lines,
+ * words, characters, bytes and the longest line, followed by @name if it's
+ * not NULL.
+ */
+void wc_print(FILE* f, unsigned what, const struct wc_counts* c, const char* name);
@@ -1,15 +1,21 @@
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "hash.h"
 #include "reader.h"
 
 /*
@@ -18,21 +24,106 @@
                 - [] rework error message reporting.
                         e.g. cp: cannot stat 'foo': No such file or directory.
                 - [] f
-                - [] R
                 - [] v
                 - [] X
         - handle C-Z correctly.
 */
 
-static int cpdir(char* src_path, char* dst_path);
-static int cpf(char* src_path, char* src_name, char* dst_path);
+/*
+ * link_map remembers where the first link of every multi-link source inode
+ * was copied to, so the other links are recreated with linkat(2) instead of
+ * copying the same data again. Slots are kept small (the path lives in a
+ * shared pool and is referenced by offset) so the table scales to millions
+ * of entries.
+ */
+struct link_entry {
+    dev_t dev;
+    ino_t ino;
+    size_t path; /* offset into link_map.pool, 0 - empty slot */
+};
+
+struct link_map {
+    struct link_entry* slots;
+    size_t cap; /* number of slots, always a power of two */
+    size_t len; /* number of used slots */
+
+    char* pool; /* NUL-terminated destination paths */
+    size_t pool_len;
+    size_t pool_cap;
+};
+
+static const char* link_map_find(struct link_map* m, dev_t dev, ino_t ino);
+static int link_map_add(struct link_map* m, dev_t dev, ino_t ino, const char* path);
+static void link_map_free(struct link_map* m);
+
+/*
+ * cp_dir is a directory on the current copy path. Entries are opened
+ * relative to @fd, full paths are only built from the chain when they are
+ * needed for a message or for the link map.
+ */
+struct cp_dir {
+    struct cp_dir* parent;
+    const char* name; /* NULL for the current working directory */
+    int fd;
+};
+
+/* cp_entry is a directory entry, entries live in the names arena. */
+struct cp_entry {
+    struct cp_entry* next;
+    unsigned char type; /* d_type of the entry */
+    char name[];
+};
+
+static int cp(char* src_path, char* dst_path);
+static int cpdir(struct cp_dir* src, struct cp_dir* dst);
+static int cpsubdir(struct cp_dir* src, struct cp_dir* dst, const char* name);
+static int cpf(struct cp_dir* src, const char* sname, struct cp_dir* dst, const char* dname);
+static int cplink(const char* old_path, struct cp_dir* dst, const char* dname);
+static int cpnode(struct cp_dir* src, struct cp_dir* dst, const char* name);
+static int make_node(const struct stat* sb, const char* link, int dfd, const char* name);
+
+static char* cp_path(struct cp_dir* d, const char* name);
+static void cp_error(const char* op, struct cp_dir* d, const char* name);
+static int close_dir(struct cp_dir* d);
+
+static FILE* open_resumed(FILE* fin,
+                          struct stat* ssb,
+                          struct cp_dir* dst,
+                          const char* dname);
+static off_t resume_offset(int sfd, int dfd, off_t ssize, off_t dsize);
 
 static int overwrite_file(char* filename);
-static int gc(FILE* rf, char* r_file, FILE* wfd, char* w_file);
+static int gc(FILE* rf,
+              struct cp_dir* rdir,
+              const char* r_file,
+              FILE* wf,
+              struct cp_dir* wdir,
+              const char* w_file);
 static void show_usage(void);
 
 static const int MAXBUFSIZ = BUFSIZ * 4;
 
+static struct link_map links;
+
+static bool is_resume = false;
+static bool is_recursive = false;
+
+static struct arena names;
+
+/* the destination root, never descend into it while copying. */
+static dev_t dst_dev;
+static ino_t dst_ino;
+
+/*
+ * In the resume mode the tail of the partial destination is verified
+ * window by window (at most RESUME_WINDOWS of them) before the copy
+ * continues, anything after the last good window is copied again.
+ */
+enum { RESUME_WINDOW = 64 * 1024, RESUME_WINDOWS = 16 };
+
+/* long only options, kept out of the range of the short ones */
+enum { OPT_RESUME = UCHAR_MAX + 1 };
+
 int main(int ac, char* av[]) {
     if (ac < 2) {
         show_usage();
@@ -52,13 +143,25 @@ int main(int ac, char* av[]) {
     bool is_file_overwrite = false;
     int opt = 0;
 
-    while ((opt = getopt(ac, av, "i")) != -1) {
+    static struct option long_opts[] = {
+        { "resume", no_argument, NULL, OPT_RESUME },
+        { NULL, 0, NULL, 0 },
+    };
+
+    while ((opt = getopt_long(ac, av, "iRr", long_opts, NULL)) != -1) {
         switch (opt) {
         case 'i':
             is_file_overwrite = true;
             break;
+        case 'R':
+        case 'r':
+            is_recursive = true;
+            break;
+        case OPT_RESUME:
+            is_resume = true;
+            break;
         default:
-            fprintf(stderr, "Usage: %s [i] source_file target_file\n", av[0]);
+            fprintf(stderr, "Usage: %s [-iR] [--resume] source_file target_file\n", av[0]);
             exit(EXIT_FAILURE);
         }
     }
@@ -66,7 +169,8 @@ int main(int ac, char* av[]) {
     char* src_path = av[ac - 2];
     char* dst_path = av[ac - 1];
 
-    if (is_file_overwrite) {
+    // the partial destination is expected to exist when resuming.
+    if (is_file_overwrite && !is_resume) {
         int overwrite = overwrite_file(dst_path);
 
         if (overwrite == -1) {
@@ -79,133 +183,588 @@ int main(int ac, char* av[]) {
         }
     }
 
-    if (cpdir(src_path, dst_path) == -1) {
-        exit(EXIT_FAILURE);
-    }
+    arena_init(&names, BUFSIZ * 8);
+
+    int ret = cp(src_path, dst_path);
 
-    exit(EXIT_SUCCESS);
+    arena_free(&names);
+    link_map_free(&links);
+    exit(ret == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
-static int cpdir(char* src_path, char* dst_path) {
-    struct dirent* d_ptr = NULL;
-    char* path = NULL;
-    const int src_len = strlen(src_path);
+/*
+ * cp copies the file @src_path to @dst_path or into it, if @dst_path is a
+ * directory. If @src_path is a directory its content is copied into
+ * @dst_path.
+ */
+static int cp(char* src_path, char* dst_path) {
+    struct cp_dir cwd = { NULL, NULL, AT_FDCWD };
+    struct cp_dir src = { NULL, src_path, -1 };
+    struct cp_dir dst = { NULL, dst_path, -1 };
+    struct stat sb;
+    int ret = -1;
+
+    if (stat(src_path, &sb) == -1) {
+        fprintf(stderr, "stat(%s): %s\n", src_path, strerror(errno));
+        return -1;
+    }
 
-    errno = 0;
-    DIR* dir = opendir(src_path);
-    if (dir == NULL) {
-        if (errno == ENOTDIR) { /* suppose that it's a file. */
-            if (cpf(src_path, NULL, dst_path) == -1) {
-                goto error;
+    if (!S_ISDIR(sb.st_mode)) {
+        if ((dst.fd = open(dst_path, O_RDONLY | O_DIRECTORY)) == -1) {
+            if (errno != ENOTDIR && errno != ENOENT) {
+                fprintf(stderr, "open(%s): %s\n", dst_path, strerror(errno));
+                return -1;
             }
-            return 0;
+            return cpf(&cwd, src_path, &cwd, dst_path);
         }
+
+        const char* base = strrchr(src_path, '/');
+        ret = cpf(&cwd, src_path, &dst, base != NULL ? base + 1 : src_path);
+        if (close_dir(&dst) == -1)
+            return -1;
+        return ret;
+    }
+
+    if (is_recursive && mkdir(dst_path, sb.st_mode & 07777) == -1 && errno != EEXIST) {
+        fprintf(stderr, "mkdir(%s): %s\n", dst_path, strerror(errno));
+        return -1;
+    }
+
+    if ((src.fd = open(src_path, O_RDONLY | O_DIRECTORY)) == -1) {
+        fprintf(stderr, "open(%s): %s\n", src_path, strerror(errno));
+        return -1;
+    }
+
+    if ((dst.fd = open(dst_path, O_RDONLY | O_DIRECTORY)) == -1) {
+        fprintf(stderr, "open(%s): %s\n", dst_path, strerror(errno));
+        goto exit;
+    }
+
+    if (fstat(dst.fd, &sb) == -1) {
+        fprintf(stderr, "fstat(%s): %s\n", dst_path, strerror(errno));
+        goto exit;
+    }
+    dst_dev = sb.st_dev;
+    dst_ino = sb.st_ino;
+
+    ret = cpdir(&src, &dst);
+
+exit:
+    if (close_dir(&src) == -1)
+        ret = -1;
+    if (close_dir(&dst) == -1)
+        ret = -1;
+    return ret;
+}
+
+/*
+ * cpdir copies the content of the @src directory into @dst. All names are
+ * read before anything is copied, so only the directory fds stay open while
+ * the copy descends into subdirectories.
+ */
+static int cpdir(struct cp_dir* src, struct cp_dir* dst) {
+    struct arena_mark mark = arena_mark(&names);
+    struct cp_entry* head = NULL;
+    struct cp_entry** tail = &head;
+    int ret = -1;
+
+    int fd = dup(src->fd);
+    if (fd == -1) {
+        cp_error("dup", src->parent, src->name);
+        return -1;
+    }
+
+    DIR* dir = fdopendir(fd);
+    if (dir == NULL) {
+        cp_error("fdopendir", src->parent, src->name);
+        close(fd);
+        return -1;
     }
 
+    struct dirent* dp = NULL;
     for (;;) {
         errno = 0;
-        d_ptr = readdir(dir);
-        if (d_ptr == NULL) {
-            if (errno == 0) {
+        if ((dp = readdir(dir)) == NULL) {
+            if (errno == 0)
                 break;
-            }
 
-            fprintf(stderr, "readdir(%s): %s\n", src_path, strerror(errno));
-            goto error;
+            cp_error("readdir", src->parent, src->name);
+            closedir(dir);
+            goto exit;
         }
 
-        if (d_ptr->d_name[0] == '.')
+        if (dp->d_name[0] == '.')
             continue;
 
-        path = (char*)malloc(src_len + strlen(d_ptr->d_name) + 3);
-        strcpy(path, src_path);
-        if (*(src_path + src_len - 1) != '/') {
-            strcat(path, "/");
+        size_t len = strlen(dp->d_name);
+        struct cp_entry* e = arena_alloc(&names, sizeof(struct cp_entry) + len + 1);
+        if (e == NULL) {
+            closedir(dir);
+            goto exit;
         }
-        strcat(path, d_ptr->d_name);
 
-        if (cpf(path, d_ptr->d_name, dst_path) == -1) {
-            goto error;
+        e->next = NULL;
+        e->type = dp->d_type;
+        memcpy(e->name, dp->d_name, len + 1);
+
+        *tail = e;
+        tail = &e->next;
+    }
+
+    if (closedir(dir) == -1) {
+        cp_error("closedir", src->parent, src->name);
+        goto exit;
+    }
+
+    struct cp_entry* e = head;
+    for (; e != NULL; e = e->next) {
+        unsigned char type = e->type;
+
+        // d_type is enough for the most of entries, stat only when the
+        // filesystem doesn't report it or the entry is a symlink to follow.
+        // -R copies symlinks as they are, a link to a parent directory would
+        // make the walk endless.
+        if (type == DT_UNKNOWN || (type == DT_LNK && !is_recursive)) {
+            const int flags = is_recursive ? AT_SYMLINK_NOFOLLOW : 0;
+            struct stat sb;
+            if (fstatat(src->fd, e->name, &sb, flags) == -1) {
+                cp_error("fstatat", src, e->name);
+                goto exit;
+            }
+            type = IFTODT(sb.st_mode);
+        }
+
+        if (type == DT_DIR) {
+            if (cpsubdir(src, dst, e->name) == -1)
+                goto exit;
+            continue;
         }
 
+        if (type != DT_REG) {
+            if (cpnode(src, dst, e->name) == -1)
+                goto exit;
+            continue;
+        }
+
+        if (cpf(src, e->name, dst, e->name) == -1)
+            goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    arena_release(&names, mark);
+    return ret;
+}
+
+static int cpsubdir(struct cp_dir* src, struct cp_dir* dst, const char* name) {
+    struct cp_dir sub_src = { src, name, -1 };
+    struct cp_dir sub_dst = { dst, name, -1 };
+    struct stat sb;
+    int ret = -1;
+
+    if (!is_recursive) {
+        char* path = cp_path(src, name);
+        fprintf(stderr, "cp: %s is a directory (not copied)\n", path != NULL ? path : name);
         free(path);
+        return 0;
     }
 
-    if (closedir(dir) == -1) {
-        fprintf(stderr, "closedir(%s): %s\n", src_path, strerror(errno));
+    if ((sub_src.fd = openat(src->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1) {
+        cp_error("openat", src, name);
         return -1;
     }
 
-    return 0;
+    if (fstat(sub_src.fd, &sb) == -1) {
+        cp_error("fstat", src, name);
+        goto exit;
+    }
 
-error:
-    free(path);
-    if (dir != NULL) {
-        if (closedir(dir) == -1) {
-            fprintf(stderr, "closedir(%s): %s\n", src_path, strerror(errno));
+    if (sb.st_dev == dst_dev && sb.st_ino == dst_ino) {
+        char* path = cp_path(src, name);
+        fprintf(stderr, "cp: cannot copy %s into itself\n", path != NULL ? path : name);
+        free(path);
+        ret = 0;
+        goto exit;
+    }
+
+    if (mkdirat(dst->fd, name, sb.st_mode & 07777) == -1 && errno != EEXIST) {
+        cp_error("mkdirat", dst, name);
+        goto exit;
+    }
+
+    if ((sub_dst.fd = openat(dst->fd, name, O_RDONLY | O_DIRECTORY)) == -1) {
+        cp_error("openat", dst, name);
+        goto exit;
+    }
+
+    ret = cpdir(&sub_src, &sub_dst);
+
+exit:
+    if (close_dir(&sub_src) == -1)
+        ret = -1;
+    if (close_dir(&sub_dst) == -1)
+        ret = -1;
+    return ret;
+}
+
+/*
+ * cpf copies @sname from the @src directory to @dname in the @dst directory.
+ */
+static int cpf(struct cp_dir* src, const char* sname, struct cp_dir* dst, const char* dname) {
+    FILE* fin = NULL;
+    FILE* fout = NULL;
+
+    int fd = openat(src->fd, sname, O_RDONLY);
+    if (fd == -1) {
+        cp_error("openat", src, sname);
+        return -1;
+    }
+
+    if ((fin = fdopen(fd, "r")) == NULL) {
+        cp_error("fdopen", src, sname);
+        close(fd);
+        return -1;
+    }
+
+    struct stat ssb;
+    if (fstat(fd, &ssb) == -1) {
+        cp_error("fstat", src, sname);
+        goto error;
+    }
+
+    if (ssb.st_nlink > 1) {
+        const char* linked = link_map_find(&links, ssb.st_dev, ssb.st_ino);
+        if (linked != NULL) {
+            if (fclose(fin) == EOF) {
+                cp_error("fclose", src, sname);
+                return -1;
+            }
+            return cplink(linked, dst, dname);
+        }
+    }
+
+    if (is_resume) {
+        if ((fout = open_resumed(fin, &ssb, dst, dname)) == NULL)
+            goto error;
+    } else {
+        if ((fd = openat(dst->fd, dname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+            cp_error("openat", dst, dname);
+            goto error;
+        }
+
+        if ((fout = fdopen(fd, "w")) == NULL) {
+            cp_error("fdopen", dst, dname);
+            close(fd);
+            goto error;
         }
     }
+
+    if (write_from_to(fin, fout) == -1) {
+        goto error;
+    }
+
+    if (ssb.st_nlink > 1) {
+        char* path = cp_path(dst, dname);
+        if (path == NULL)
+            goto error;
+
+        int ret = link_map_add(&links, ssb.st_dev, ssb.st_ino, path);
+        free(path);
+        if (ret == -1)
+            goto error;
+    }
+
+    return gc(fin, src, sname, fout, dst, dname);
+
+error:
+    gc(fin, src, sname, fout, dst, dname);
     return -1;
 }
 
-static int cpf(char* src_path, char* src_name, char* dst_path) {
-    const int dst_len = strlen(dst_path);
-    char dst_buf[strlen(src_path) + dst_len + 3];
+/*
+ * cp_path builds the path of @name in the @d directory, the caller is
+ * responsible for freeing it.
+ */
+static char* cp_path(struct cp_dir* d, const char* name) {
+    size_t len = strlen(name) + 1;
+    struct cp_dir* p = d;
+    for (; p != NULL && p->name != NULL; p = p->parent)
+        len += strlen(p->name) + 1;
+
+    char* path = malloc(len);
+    if (path == NULL) {
+        fprintf(stderr, "malloc, no memory\n");
+        return NULL;
+    }
 
-    strcpy(dst_buf, dst_path);
-    if (*(dst_path + dst_len - 1) != '/') {
-        strcat(dst_buf, "/");
+    char* end = path + len - 1;
+    *end = '\0';
+
+    size_t n = strlen(name);
+    end -= n;
+    memcpy(end, name, n);
+
+    for (p = d; p != NULL && p->name != NULL; p = p->parent) {
+        *--end = '/';
+        n = strlen(p->name);
+        end -= n;
+        memcpy(end, p->name, n);
     }
-    if (src_name == NULL) {
-        strcat(dst_buf, src_path);
-    } else {
-        strcat(dst_buf, src_name);
+
+    return path;
+}
+
+static void cp_error(const char* op, struct cp_dir* d, const char* name) {
+    int err = errno;
+    char* path = cp_path(d, name);
+    fprintf(stderr, "%s(%s): %s\n", op, path != NULL ? path : name, strerror(err));
+    free(path);
+}
+
+static int close_dir(struct cp_dir* d) {
+    if (d->fd == -1)
+        return 0;
+
+    if (close(d->fd) == -1) {
+        cp_error("close", d->parent, d->name);
+        d->fd = -1;
+        return -1;
     }
 
-    if (access(dst_path, F_OK) != -1) {
-        struct stat dsb;
-        if (stat(dst_path, &dsb) == -1) {
-            fprintf(stderr, "stat(%s): %s\n", dst_path, strerror(errno));
-            return -1;
-        }
+    d->fd = -1;
+    return 0;
+}
 
-        if (S_ISDIR(dsb.st_mode))
-            dst_path = dst_buf;
+/*
+ * open_resumed opens @dname without truncating it and positions both @fin
+ * and the returned stream at the offset the copy should continue from.
+ */
+static FILE* open_resumed(FILE* fin,
+                          struct stat* ssb,
+                          struct cp_dir* dst,
+                          const char* dname) {
+    int fd = openat(dst->fd, dname, O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        cp_error("openat", dst, dname);
+        return NULL;
     }
 
-    FILE* fin = fopen(src_path, "r");
-    FILE* fout = NULL;
-    if (fin == NULL) {
-        fprintf(stderr, "fopen(%s): %s\n", src_path, strerror(errno));
+    struct stat dsb;
+    if (fstat(fd, &dsb) == -1) {
+        cp_error("fstat", dst, dname);
         goto error;
     }
 
-    fout = fopen(dst_path, "w");
-    if (fout == NULL) {
-        fprintf(stderr, "fopen(%s): %s\n", dst_path, strerror(errno));
+    off_t off = 0;
+    if (S_ISREG(ssb->st_mode) && S_ISREG(dsb.st_mode))
+        off = resume_offset(fileno(fin), fd, ssb->st_size, dsb.st_size);
+    if (off == -1)
+        goto error;
+
+    if (S_ISREG(dsb.st_mode) && ftruncate(fd, off) == -1) {
+        cp_error("ftruncate", dst, dname);
         goto error;
     }
 
-    if (write_from_to(fin, fout) == -1) {
+    FILE* fout = fdopen(fd, "r+");
+    if (fout == NULL) {
+        cp_error("fdopen", dst, dname);
         goto error;
     }
 
-    return gc(fin, src_path, fout, dst_path);
+    if (fseeko(fout, off, SEEK_SET) == -1 || fseeko(fin, off, SEEK_SET) == -1) {
+        perror("fseeko");
+        fclose(fout);
+        return NULL;
+    }
+
+    return fout;
 
 error:
-    if (fin != NULL) {
-        if (fclose(fin) == -1) {
-            fprintf(stderr, "fclose(%s): %s\n", src_path, strerror(errno));
-        }
+    if (close(fd) == -1)
+        cp_error("close", dst, dname);
+    return NULL;
+}
+
+/*
+ * resume_offset returns the end of the last destination window that has
+ * the same content as the source, or 0 if the copy has to start over.
+ */
+static off_t resume_offset(int sfd, int dfd, off_t ssize, off_t dsize) {
+    if (dsize > ssize)
+        return 0;
+
+    off_t end = dsize;
+    int n = 0;
+    for (; end > 0 && n < RESUME_WINDOWS; n++) {
+        off_t start = end > RESUME_WINDOW ? end - RESUME_WINDOW : 0;
+        size_t len = end - start;
+
+        uint64_t sh = 0, dh = 0;
+        if (fnv1a_window(sfd, start, len, &sh) == -1
+            || fnv1a_window(dfd, start, len, &dh) == -1)
+            return -1;
+        if (sh == dh)
+            return end;
+
+        end = start;
+    }
+
+    return 0;
+}
+
+/*
+ * cplink makes @dname in the @dst directory another link to the already
+ * copied @old_path, replacing whatever @dname was before.
+ */
+static int cplink(const char* old_path, struct cp_dir* dst, const char* dname) {
+    if (linkat(AT_FDCWD, old_path, dst->fd, dname, 0) == 0)
+        return 0;
+
+    if (errno != EEXIST) {
+        cp_error("linkat", dst, dname);
+        return -1;
+    }
+
+    if (unlinkat(dst->fd, dname, 0) == -1) {
+        cp_error("unlinkat", dst, dname);
+        return -1;
+    }
+
+    if (linkat(AT_FDCWD, old_path, dst->fd, dname, 0) == -1) {
+        cp_error("linkat", dst, dname);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * cpnode recreates the @name symlink, fifo, socket or device of the @src
+ * directory in @dst instead of reading it, as cpf would do. An existing
+ * destination is replaced.
+ */
+static int cpnode(struct cp_dir* src, struct cp_dir* dst, const char* name) {
+    char target[PATH_MAX];
+    struct stat sb;
+
+    if (fstatat(src->fd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+        cp_error("fstatat", src, name);
+        return -1;
     }
-    if (fout != NULL) {
-        if (fclose(fout) == -1) {
-            fprintf(stderr, "fclose(%s): %s\n", dst_path, strerror(errno));
+
+    if (S_ISLNK(sb.st_mode)) {
+        ssize_t n = readlinkat(src->fd, name, target, sizeof(target));
+        if (n == -1) {
+            cp_error("readlinkat", src, name);
+            return -1;
         }
+        if ((size_t)n == sizeof(target)) {
+            errno = ENAMETOOLONG;
+            cp_error("readlinkat", src, name);
+            return -1;
+        }
+        target[n] = '\0';
     }
+
+    if (make_node(&sb, target, dst->fd, name) == 0)
+        return 0;
+
+    if (errno == EEXIST && unlinkat(dst->fd, name, 0) == 0
+        && make_node(&sb, target, dst->fd, name) == 0)
+        return 0;
+
+    cp_error(S_ISLNK(sb.st_mode) ? "symlinkat" : "mknodat", dst, name);
     return -1;
 }
 
+static int make_node(const struct stat* sb, const char* link, int dfd, const char* name) {
+    if (S_ISLNK(sb->st_mode))
+        return symlinkat(link, dfd, name);
+    return mknodat(dfd, name, sb->st_mode, sb->st_rdev);
+}
+
+static const char* link_map_find(struct link_map* m, dev_t dev, ino_t ino) {
+    if (m->len == 0)
+        return NULL;
+
+    size_t i = hash_slot(hash_inode(dev, ino), m->cap);
+    for (; m->slots[i].path != 0; i = hash_next(i, m->cap)) {
+        if (m->slots[i].ino == ino && m->slots[i].dev == dev)
+            return m->pool + m->slots[i].path;
+    }
+
+    return NULL;
+}
+
+static void link_map_put(struct link_map* m, struct link_entry* e) {
+    size_t i = hash_slot(hash_inode(e->dev, e->ino), m->cap);
+    while (m->slots[i].path != 0)
+        i = hash_next(i, m->cap);
+    m->slots[i] = *e;
+}
+
+static int link_map_add(struct link_map* m, dev_t dev, ino_t ino, const char* path) {
+    if (hash_full(m->len, m->cap)) {
+        size_t ncap = m->cap == 0 ? 1024 : m->cap * 2;
+        struct link_entry* slots = calloc(ncap, sizeof(struct link_entry));
+        if (slots == NULL) {
+            fprintf(stderr, "calloc, no memory\n");
+            return -1;
+        }
+
+        struct link_entry* old = m->slots;
+        size_t ocap = m->cap;
+        m->slots = slots;
+        m->cap = ncap;
+
+        size_t i = 0;
+        for (; i < ocap; i++) {
+            if (old[i].path != 0)
+                link_map_put(m, &old[i]);
+        }
+        free(old);
+    }
+
+    const size_t plen = strlen(path) + 1;
+    if (m->pool_len == 0)
+        m->pool_len = 1; /* offset 0 marks an empty slot */
+
+    if (m->pool_len + plen > m->pool_cap) {
+        size_t ncap = m->pool_cap == 0 ? BUFSIZ : m->pool_cap;
+        while (m->pool_len + plen > ncap)
+            ncap *= 2;
+
+        char* pool = realloc(m->pool, ncap);
+        if (pool == NULL) {
+            fprintf(stderr, "realloc, no memory\n");
+            return -1;
+        }
+        m->pool = pool;
+        m->pool_cap = ncap;
+    }
+
+    struct link_entry e;
+    e.dev = dev;
+    e.ino = ino;
+    e.path = m->pool_len;
+
+    memcpy(m->pool + m->pool_len, path, plen);
+    m->pool_len += plen;
+
+    link_map_put(m, &e);
+    m->len++;
+
+    return 0;
+}
+
+static void link_map_free(struct link_map* m) {
+    free(m->slots);
+    free(m->pool);
+    memset(m, 0, sizeof(*m));
+}
+
 static int overwrite_file(char* filename) {
     FILE* tty = NULL;
 
@@ -254,20 +813,25 @@ error:
     return -1;
 }
 
-static int gc(FILE* rf, char* r_file, FILE* wf, char* w_file) {
+static int gc(FILE* rf,
+              struct cp_dir* rdir,
+              const char* r_file,
+              FILE* wf,
+              struct cp_dir* wdir,
+              const char* w_file) {
     int is_err = 0;
 
     if (rf != NULL) {
         if ((fclose(rf)) == -1) {
             is_err = -1;
-            fprintf(stderr, "fclose(%s): %s\n", r_file, strerror(errno));
+            cp_error("fclose", rdir, r_file);
         }
     }
 
     if (wf != NULL) {
         if ((fclose(wf)) == -1) {
             is_err = -1;
-            fprintf(stderr, "fclose(%s): %s\n", w_file, strerror(errno));
+            cp_error("fclose", wdir, w_file);
         }
     }
 
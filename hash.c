@@ -0,0 +1,58 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+uint64_t fnv1a(uint64_t h, const void* buf, size_t len) {
+    const unsigned char* p = buf;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+size_t hash_slot(uint64_t h, size_t cap) {
+    if (cap <= 1)
+        return 0;
+    return (size_t)((h * 0x9e3779b97f4a7c15ULL) >> (64 - __builtin_ctzll(cap)));
+}
+
+size_t hash_next(size_t i, size_t cap) {
+    return (i + 1) & (cap - 1);
+}
+
+int hash_full(size_t len, size_t cap) {
+    return (len + 1) * 2 > cap;
+}
+
+uint64_t hash_inode(dev_t dev, ino_t ino) {
+    return (uint64_t)ino ^ ((uint64_t)dev << 32 | (uint64_t)dev >> 32);
+}
+
+int fnv1a_window(int fd, off_t off, size_t len, uint64_t* h) {
+    char buf[BUFSIZ * 4];
+
+    *h = FNV1A_INIT;
+    while (len > 0) {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, off);
+        if (n == -1) {
+            perror("pread");
+            return -1;
+        }
+        if (n == 0) { /* the file became shorter */
+            *h ^= 1;
+            return 0;
+        }
+
+        *h = fnv1a(*h, buf, n);
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
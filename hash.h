@@ -0,0 +1,39 @@
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * FNV-1a, a simple byte at a time hash. fnv1a continues the hash @h of the
+ * previous bytes, start with FNV1A_INIT.
+ */
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+uint64_t fnv1a(uint64_t h, const void* buf, size_t len);
+
+/*
+ * fnv1a_window stores to @h the hash of @len bytes of @fd at @off. A file
+ * shorter than @off + @len gets a different hash than the full window.
+ * Returns -1 in case of the error.
+ */
+int fnv1a_window(int fd, off_t off, size_t len, uint64_t* h);
+
+/*
+ * The open addressing tables (cp links, the pwc cache, the sh command paths,
+ * the ls id and inode caches) keep a power of two number of slots and probe
+ * linearly, from hash_slot on with hash_next.
+ *
+ * hash_slot maps @h to a slot of a table of @cap slots. It's Fibonacci
+ * hashing: the product keeps the mixed bits in its high end, so they are
+ * taken and even sequential keys like inode numbers spread out.
+ */
+size_t hash_slot(uint64_t h, size_t cap);
+size_t hash_next(size_t i, size_t cap);
+
+/*
+ * hash_full tells whether a table of @len entries in @cap slots has to grow
+ * before one more is added. The load factor is kept under 1/2, probe
+ * sequences stay short.
+ */
+int hash_full(size_t len, size_t cap);
+
+/* hash_inode is the key of the file (@dev, @ino) for hash_slot. */
+uint64_t hash_inode(dev_t dev, ino_t ino);
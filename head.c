@@ -69,33 +69,7 @@ int main(int ac, char* av[]) {
 }
 
 static int read_head_lines(FILE* f) {
-    int c = 0;
-    int n = 0; // number of lines that were already read
-
-    while ((c = getc(f)) != EOF) {
-        if (ferror(f) != 0) {
-            perror("ferror");
-            return -1;
-        }
-
-        if (c == '\n') {
-            if (++n == nlines) {
-                if (putchar(c) == EOF) {
-                    perror("putchar");
-                    return -1;
-                }
-
-                break;
-            }
-        }
-
-        if (putchar(c) == EOF) {
-            perror("putchar");
-            return -1;
-        }
-    }
-
-    return 0;
+    return head_lines(f, stdout, nlines);
 }
 
 static int read_head_bytes(FILE* f) {
@@ -1,22 +1,33 @@
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <grp.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "arena.h"
+#include "hash.h"
+
 /*
         TODO:
-                1. Multi-colon output.
                 2. Colorful output (to distinguish dir and file).
-                3. Sort option.
                 4. Author option.
                 4. Directory option.
                 6. Inode option.
@@ -25,39 +36,327 @@
 
 struct flags {
     int dot;    /* print or not the hidden files */
-    char sort;  /* the sorting type */
+    char sort;  /* the sorting type: n - name, t - mtime, S - size, d - none */
+    int reverse; /* reverse the sorting order */
     int format; /* true - use long format, else - short format */
     int inode;  /* print inode number or not */
+    int columns; /* short format in columns, the terminal width is @width */
+    int usage;   /* print the disk usage of directories instead, see du_walk */
+    int width;
+    int deep;   /* list subdirs recursively */
+};
+
+/*
+ * dentry is a directory entry as the directory reader returns it. The type
+ * is one of DT_*, DT_UNKNOWN if the file system doesn't report it.
+ */
+struct dentry {
+    char* name;
+    unsigned char type;
+    ino_t ino;
+};
+
+/*
+ * entry is the compact record of a listed file. The records and the names of
+ * a directory are carved from the arena and released together when the
+ * directory is done. The metadata is filled only if the output needs it, see
+ * stat_entries.
+ */
+struct entry {
+    char* name;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    blkcnt_t blocks;
+    nlink_t nlink;
+    uid_t uid;
+    gid_t gid;
+    mode_t mode;
+    unsigned char type; /* DT_* */
+    int err;            /* errno of the failed fstatat */
+    uint64_t key;       /* the sort key, see sort_listing */
+    size_t width;       /* display width in columns, see print_columns */
+};
+
+/* listing is the set of entries of one directory */
+struct listing {
+    const char* path; /* NULL - a file given on the command line */
+    struct entry** entries;
+    size_t n;
+    size_t cap;
+};
 
-    char* dir; /* parent dir */
-    int deep;  /* list subdirs recursively */
+/*
+ * dirstream reads a directory. On Linux a large buffer is filled by the
+ * getdents64 system call, so a huge directory costs a few system calls per
+ * thousand entries. Elsewhere readdir(3) is used.
+ */
+#ifdef __linux__
+enum { DIRBUF_SIZE = 256 * 1024 };
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
 
-    int eod;       /* the last entry in the directory - we can print */
-    size_t nidx;   /* current number of file names */
-    size_t nsize;  /* max number of file names */
-    char** names;  /* files names */
-    blkcnt_t bcnt; /* number of 512B blocks allocated */
+struct dirstream {
+    int fd;
+    char* buf;
+    size_t len; /* bytes filled by the last getdents64 */
+    size_t pos; /* offset of the next record in @buf */
+};
+#else
+struct dirstream {
+    DIR* dir;
 };
+#endif
 
-static void dirwalk(struct flags* f, void (*fcn)(char*, struct flags*));
-static void fstraverse(char* dir, struct flags* f);
-static void init_flag(struct flags* f);
-static void new_flag(struct flags* src, struct flags* dst);
-static void finfo(int print_inode, char* buf, char* name, struct stat* sb);
+/*
+ * Directories with many entries to stat are stat'ed by a few threads, on
+ * NFS or FUSE every stat is a round trip and they are overlapped this way.
+ * Every thread takes STAT_BATCH entries at a time.
+ */
+enum { STAT_THREADS = 16, STAT_BATCH = 64, STAT_PER_THREAD = 256 };
+
+struct stat_batch {
+    int dirfd;
+    int all; /* stat every entry, not only the ones of an unknown type */
+    struct entry** entries;
+    size_t n;
+    size_t next; /* the first entry not taken by a thread */
+};
+
+/*
+ * -R reads the directories of the tree in parallel. Every directory is a
+ * dirnode, the worker reading it creates the nodes of its subdirectories and
+ * pushes them to the tree stack, the first subdirectory on top, so the
+ * directories are read roughly in the order they are printed. The calling
+ * thread is the sequencer: it prints the nodes in the pre-order (a directory,
+ * then the subtrees of its subdirectories) and reads a node itself if no
+ * worker took it yet. Workers stop reading ahead when TREE_AHEAD nodes are
+ * read but not printed.
+ */
+enum { TREE_THREADS = 8, TREE_AHEAD = 256, NODE_ARENA_BLOCK_SIZE = 64 * 1024 };
+
+enum { NODE_QUEUED, NODE_READING, NODE_READY };
+
+struct dirnode {
+    char* path;
+    struct arena mem; /* the entries of the directory */
+    struct listing l;
+    int state;
+    int err;       /* errno of the failed opendir, 0 if ok */
+    int close_err; /* errno of the failed closedir, 0 if ok */
+    int ok;        /* the entries were read */
+
+    struct dirnode** subdirs;
+    size_t nsubdirs;
+};
+
+struct tree {
+    struct flags* f;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;  /* a node was pushed or printed or the walk is over */
+    pthread_cond_t ready; /* a node was read */
+
+    struct dirnode** stack;
+    size_t n;
+    size_t cap;
+    size_t ahead; /* nodes read but not printed yet */
+    int stop;
+};
+
+/*
+ * -D prints the disk usage of every directory of a tree, like du(1): the 1K
+ * blocks of the directory with its subtree, the subdirectories first. The
+ * directories are read by TREE_THREADS workers (and the calling thread)
+ * taking them from a shared stack, the entries are stat'ed relative to the
+ * directory descriptor. The files with several links are only collected by
+ * the workers, they are counted once, where the serial walk meets them
+ * first, by du_sum. So the output doesn't depend on the thread timing.
+ */
+struct dulink {
+    dev_t dev;
+    ino_t ino;
+    blkcnt_t blocks;
+};
+
+struct dunode {
+    char* path;              /* for the messages and the output only */
+    const char* name;        /* the last component of @path, opened in @parent */
+    struct dunode* parent;   /* NULL for the root */
+    struct dunode** subdirs; /* sorted by name */
+    size_t nsubdirs;
+    int fd;        /* the directory kept open for its subdirectories, or -1 */
+    size_t unread; /* the subdirectories not opened yet, @fd is closed at 0 */
+
+    blkcnt_t blocks; /* of the directory and its files, of the subtree after du_sum */
+    struct dulink* links;
+    size_t nlinks;
+};
+
+/* inode_set is an open addressing set of the files with several links */
+struct inode_key {
+    dev_t dev;
+    ino_t ino;
+    int used;
+};
+
+struct inode_set {
+    struct inode_key* slots;
+    size_t cap;
+    size_t len;
+};
+
+struct du {
+    pthread_mutex_t lock;
+    pthread_cond_t work; /* a node was pushed or the walk is over */
+
+    struct dunode** stack;
+    size_t n;
+    size_t cap;
+    size_t active; /* nodes pushed and not read yet */
+};
+
+/*
+ * The output is formatted into one large buffer which is written out when it
+ * fills up and at the exit.
+ */
+enum { OUTBUF_SIZE = 256 * 1024, LINE_PREFIX_MAX = 256 };
+
+enum { ARENA_BLOCK_SIZE = 1024 * 1024 };
+
+/*
+ * Unsorted (-U) listings are printed as they are read, STREAM_BATCH entries
+ * at a time, so the memory doesn't depend on the directory size.
+ */
+enum { STREAM_BATCH = 4096 };
+
+static int dir_open(struct dirstream* d, const char* path);
+static int dir_openat(struct dirstream* d, int dirfd, const char* name);
+static int dir_next(struct dirstream* d, struct dentry* e);
+static int dir_close(struct dirstream* d);
+static int dir_fd(struct dirstream* d);
+
+static void fstraverse(char* path, struct flags* f);
+static void dirwalk(const char* path, struct flags* f);
+static int stream_dir(struct dirstream* d,
+                      struct listing* l,
+                      struct listing* subdirs,
+                      struct arena* keep,
+                      struct flags* f);
+static void walk_subdirs(const char* path, struct listing* l, struct flags* f);
+static int read_entries(struct dirstream* d,
+                        struct listing* l,
+                        struct arena* a,
+                        struct flags* f,
+                        size_t max);
+static int add_entry(struct listing* l, struct entry* e);
+static void sort_listing(struct listing* l, struct flags* f);
+static void print_listing(struct listing* l, struct flags* f);
+static void print_header(struct listing* l, struct flags* f);
+static void print_total(blkcnt_t blocks);
+static void print_entries(struct listing* l, struct flags* f);
+static void print_entry(struct entry* e, struct flags* f);
+static void print_columns(struct listing* l, struct flags* f);
+static size_t entry_width(struct entry* e, struct flags* f);
+static int term_width(void);
+static void
+stat_entries(int dirfd, int all, struct entry** entries, size_t n, int parallel);
+static void* stat_worker(void* p);
+static void stat_to_entry(struct stat* sb, struct entry* e);
+static int is_dir(struct entry* e);
+
+static void tree_walk(char* path, struct flags* f);
+static void* tree_worker(void* p);
+static void tree_print(struct tree* t, struct dirnode* node);
+static void read_node(struct tree* t, struct dirnode* node);
+static struct dirnode* new_node(const char* dir, const char* name);
+static void free_node(struct dirnode* node);
+
+static void du_walk(char* path);
+static void* du_worker(void* p);
+static void du_read(struct du* du, struct dunode* node);
+static int du_push(struct du* du, struct dunode* node);
+static void du_sum(struct dunode* node, struct inode_set* seen);
+static void du_print(struct dunode* node);
+static int first_link(struct inode_set* s, dev_t dev, ino_t ino);
+static int dunode_cmp(const void* p1, const void* p2);
+
+static void out_flush(void);
+static char* out_reserve(size_t n);
+static void out_str(const char* s, size_t n);
+
+/*
+ * id_cache maps user or group ids to names for the whole run, the name
+ * service (maybe LDAP or SSSD) is asked once per id. An unknown id is cached
+ * as its number. The table is open addressing with linear probing.
+ */
+struct id_name {
+    unsigned id;
+    char* name; /* NULL - an empty slot */
+};
+
+struct id_cache {
+    struct id_name* slots;
+    size_t cap;
+    size_t len;
+};
+
+/*
+ * The long format time is "Mon dd hh:mm" in the local time, as ctime(3)
+ * prints it. localtime runs once per day: the start of a day and its
+ * "Mon dd " part are kept in a small direct-mapped cache, the hours and the
+ * minutes are computed from the offset in the day. A day with a change of
+ * the UTC offset isn't cached.
+ */
+enum { TIME_LEN = 12, DAY_CACHE_SIZE = 64 };
+
+struct day {
+    time_t start; /* the local midnight */
+    int valid;
+    char date[7]; /* "Mon dd " */
+};
 
+static void format_time(time_t t, char* buf);
 static void mode_to_str(mode_t m, char* buf);
-static char* gid_to_name(gid_t gid);
-static char* uid_to_name(uid_t uid);
+static const char* gid_to_name(gid_t gid);
+static const char* uid_to_name(uid_t uid);
 
-static int stringcmp(const void* p1, const void* p2);
-static int rev_stringcmp(const void* p1, const void* p2);
+static struct id_name* id_lookup(struct id_cache* c, unsigned id);
+static const char* id_put(struct id_cache* c, unsigned id, const char* name);
+
+static int needs_meta(struct flags* f);
+static uint64_t name_key(const char* name);
+static int radix_sort(struct entry** entries, size_t n);
+static int namecmp(const void* p1, const void* p2);
+static int keycmp(const void* p1, const void* p2);
+
+static struct id_cache users;
+static struct id_cache groups;
+
+static struct day days[DAY_CACHE_SIZE];
+
+/* entries and names of the directories being listed */
+static struct arena mem;
+
+static char outbuf[OUTBUF_SIZE];
+static size_t outlen = 0;
 
 int main(int ac, char* av[]) {
     struct flags f;
-    init_flag(&f);
+    memset(&f, 0, sizeof(f));
+    f.sort = 'n';
+
+    // columns are for humans, pipes get a name per line.
+    f.columns = isatty(STDOUT_FILENO);
 
     int opt = 0;
-    while ((opt = getopt(ac, av, "aliUrR")) != -1) {
+    while ((opt = getopt(ac, av, "aliUrRtS1CD")) != -1) {
         switch (opt) {
         case 'a':
             f.dot = 1;
@@ -69,7 +368,13 @@ int main(int ac, char* av[]) {
             f.sort = 'd';
             break;
         case 'r':
-            f.sort = 'r';
+            f.reverse = 1;
+            break;
+        case 't':
+            f.sort = 't';
+            break;
+        case 'S':
+            f.sort = 'S';
             break;
         case 'R':
             f.deep = 1;
@@ -77,218 +382,1397 @@ int main(int ac, char* av[]) {
         case 'i':
             f.inode = 1;
             break;
+        case '1':
+            f.columns = 0;
+            break;
+        case 'C':
+            f.columns = 1;
+            break;
+        case 'D':
+            f.usage = 1;
+            break;
         default:
             exit(EXIT_FAILURE);
         }
     }
 
+    if (f.format)
+        f.columns = 0;
+    if (f.columns)
+        f.width = term_width();
+
+    arena_init(&mem, ARENA_BLOCK_SIZE);
+
     if (ac == optind) {
         fstraverse(".", &f);
     } else {
-        char** files = av + optind;
-        struct flags nf;
-        while (--ac >= optind) {
-            new_flag(&f, &nf);
-            fstraverse(*files++, &nf);
-        }
+        for (int i = optind; i < ac; i++)
+            fstraverse(av[i], &f);
     }
 
+    out_flush();
     exit(EXIT_SUCCESS);
 }
 
-static void init_flag(struct flags* f) {
-    f->names = NULL;
-    f->nidx = 0;
-    f->nsize = 0;
-    f->sort = 'n';
-    f->format = 0;
-    f->dot = 0;
-    f->eod = 0;
-    f->dir = NULL;
-    f->deep = 0;
-    f->bcnt = 0;
-    f->inode = 0;
-}
+/*
+ * fstraverse lists a command line argument: the content of a directory or
+ * the file itself.
+ */
+static void fstraverse(char* path, struct flags* f) {
+    struct stat sb;
+    if (stat(path, &sb) == -1) {
+        fprintf(stderr, "stat(%s): %s\n", path, strerror(errno));
+        return;
+    }
+
+    if (f->usage) {
+        if (S_ISDIR(sb.st_mode)) {
+            du_walk(path);
+        } else {
+            char* p = out_reserve(LINE_PREFIX_MAX);
+            outlen += sprintf(p, "%lu\t", (unsigned long)sb.st_blocks / 2);
+            out_str(path, strlen(path));
+            out_str("\n", 1);
+        }
+        return;
+    }
+
+    if (S_ISDIR(sb.st_mode)) {
+        // the unsorted listing is streamed, so it's walked serially.
+        if (f->deep && f->sort != 'd')
+            tree_walk(path, f);
+        else
+            dirwalk(path, f);
+        return;
+    }
+
+    char* slash = strrchr(path, '/');
+    if ((slash != NULL ? slash[1] : path[0]) == '.' && !f->dot)
+        return;
 
-static void new_flag(struct flags* src, struct flags* dst) {
-    init_flag(dst);
-    dst->sort = src->sort;
-    dst->format = src->format;
-    dst->dot = src->dot;
-    dst->deep = src->deep;
-    dst->inode = src->inode;
+    struct entry e;
+    memset(&e, 0, sizeof(e));
+    e.name = path;
+    stat_to_entry(&sb, &e);
+
+    struct entry* ep = &e;
+    struct listing l = { NULL, &ep, 1, 1 };
+    print_listing(&l, f);
 }
 
-static void dirwalk(struct flags* f, void (*fcn)(char*, struct flags*)) {
-    errno = 0;
-    DIR* dir = opendir(f->dir);
-    if (dir == NULL) {
-        fprintf(stderr, "opendir(%s): %s\n", f->dir, strerror(errno));
-        goto exit;
+/*
+ * dirwalk lists the directory @path and, with -R, its subdirectories after
+ * it. Everything allocated for the directory is released before returning.
+ */
+static void dirwalk(const char* path, struct flags* f) {
+    struct arena_mark m = arena_mark(&mem);
+    struct listing l;
+    memset(&l, 0, sizeof(l));
+    l.path = path;
+
+    struct dirstream d;
+    if (dir_open(&d, path) == -1) {
+        fprintf(stderr, "opendir(%s): %s\n", path, strerror(errno));
+        return;
     }
 
-    struct dirent* dp = NULL;
-    for (;;) {
-        errno = 0;
-        dp = readdir(dir);
-        if (dp == NULL) {
-            if (errno == 0) {
-                f->eod = 1;
-                (*fcn)(NULL, f);
+    // the columns layout needs all the entries, it can't be streamed.
+    if (f->sort == 'd' && !f->columns) {
+        struct listing subdirs;
+        memset(&subdirs, 0, sizeof(subdirs));
+        subdirs.path = path;
+
+        struct arena keep;
+        arena_init(&keep, BUFSIZ * 8);
+
+        int ret = stream_dir(&d, &l, &subdirs, &keep, f);
+        if (dir_close(&d) == -1) {
+            fprintf(stderr, "closedir(%s): %s\n", path, strerror(errno));
+        }
+        if (ret == 0)
+            walk_subdirs(path, &subdirs, f);
+
+        free(subdirs.entries);
+        arena_free(&keep);
+        goto out;
+    }
+
+    int ret = read_entries(&d, &l, &mem, f, SIZE_MAX);
+    if (ret == 0) {
+        // -i takes the inode number from the directory entry, -R stats only
+        // the entries of an unknown type, the long format and the -t and -S
+        // sorting need all of them.
+        if (needs_meta(f) || f->deep)
+            stat_entries(dir_fd(&d), needs_meta(f), l.entries, l.n, 1);
+    }
+
+    if (dir_close(&d) == -1) {
+        fprintf(stderr, "closedir(%s): %s\n", path, strerror(errno));
+    }
+
+    if (ret == 0) {
+        sort_listing(&l, f);
+        print_listing(&l, f);
+        walk_subdirs(path, &l, f);
+    }
+
+out:
+    free(l.entries);
+    arena_release(&mem, m);
+}
+
+/*
+ * stream_dir lists @d in the directory order without keeping it: every
+ * STREAM_BATCH entries are stat'ed (if needed), printed and released. Only
+ * the subdirectories are kept for -R, in @subdirs allocated from @keep. With
+ * -l the total is known at the end only, it's printed after the entries.
+ * Returns -1 in case of the error.
+ */
+static int stream_dir(struct dirstream* d,
+                      struct listing* l,
+                      struct listing* subdirs,
+                      struct arena* keep,
+                      struct flags* f) {
+    blkcnt_t blocks = 0;
+    int ret = 1;
+
+    print_header(l, f);
+
+    while (ret == 1) {
+        struct arena_mark m = arena_mark(&mem);
+        l->n = 0;
+
+        if ((ret = read_entries(d, l, &mem, f, STREAM_BATCH)) == -1)
+            break;
+        if (needs_meta(f) || f->deep)
+            stat_entries(dir_fd(d), needs_meta(f), l->entries, l->n, 1);
+
+        print_entries(l, f);
+
+        for (size_t i = 0; i < l->n; i++) {
+            struct entry* e = l->entries[i];
+            blocks += e->blocks;
+            if (!f->deep || e->err != 0 || !is_dir(e))
+                continue;
+
+            struct entry* sub = arena_alloc(keep, sizeof(struct entry));
+            if (sub == NULL) {
+                fprintf(stderr, "arena_alloc, no memory\n");
+                ret = -1;
+                break;
+            }
+            *sub = *e;
+            if ((sub->name = arena_strndup(keep, e->name, strlen(e->name))) == NULL
+                || add_entry(subdirs, sub) == -1) {
+                fprintf(stderr, "arena_strndup, no memory\n");
+                ret = -1;
                 break;
             }
+        }
+
+        arena_release(&mem, m);
+        out_flush();
+    }
+
+    if (f->format)
+        print_total(blocks);
+
+    return ret;
+}
+
+/* walk_subdirs lists the subdirectories among @l entries for -R */
+static void walk_subdirs(const char* path, struct listing* l, struct flags* f) {
+    for (size_t i = 0; f->deep && i < l->n; i++) {
+        struct entry* e = l->entries[i];
+        if (e->err != 0 || !is_dir(e))
+            continue;
 
-            fprintf(stderr, "readdir(%s): %s\n", f->dir, strerror(errno));
-            goto exit;
+        size_t pl = strlen(path);
+        size_t nl = strlen(e->name);
+        char* sub = arena_alloc(&mem, pl + nl + 2);
+        if (sub == NULL) {
+            fprintf(stderr, "arena_alloc, no memory\n");
+            break;
         }
+        memcpy(sub, path, pl);
+        sub[pl] = '/';
+        memcpy(sub + pl + 1, e->name, nl + 1);
+
+        dirwalk(sub, f);
+    }
+}
+
+/*
+ * read_entries reads at most @max entries of @d into @l. Returns 1 if @max
+ * entries were read, 0 at the end of the directory and -1 in case of the
+ * error.
+ */
+static int read_entries(struct dirstream* d,
+                        struct listing* l,
+                        struct arena* a,
+                        struct flags* f,
+                        size_t max) {
+    struct dentry de;
+    int ret = 0;
+
+    for (size_t n = 0; n < max;) {
+        if ((ret = dir_next(d, &de)) <= 0)
+            break;
 
-        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) {
+        if (strcmp(de.name, ".") == 0 || strcmp(de.name, "..") == 0) {
+            continue;
+        }
+        if (de.name[0] == '.' && !f->dot) {
             continue;
         }
 
-        (*fcn)(dp->d_name, f);
+        struct entry* e = arena_alloc(a, sizeof(struct entry));
+        if (e == NULL) {
+            fprintf(stderr, "arena_alloc, no memory\n");
+            return -1;
+        }
+        memset(e, 0, sizeof(*e));
+        if ((e->name = arena_strndup(a, de.name, strlen(de.name))) == NULL) {
+            fprintf(stderr, "arena_strndup, no memory\n");
+            return -1;
+        }
+        e->ino = de.ino;
+        e->type = de.type;
+
+        if (add_entry(l, e) == -1)
+            return -1;
+        n++;
     }
-    goto exit;
 
-exit:
-    if (dir != NULL) {
-        if (closedir(dir) == -1) {
-            fprintf(stderr, "closedir(%s): %s\n", f->dir, strerror(errno));
+    if (ret == -1) {
+        fprintf(stderr, "readdir(%s): %s\n", l->path, strerror(errno));
+        return -1;
+    }
+
+    return ret;
+}
+
+static int add_entry(struct listing* l, struct entry* e) {
+    if (l->n == l->cap) {
+        size_t ncap = l->cap == 0 ? 64 : l->cap * 2;
+        struct entry** p = realloc(l->entries, ncap * sizeof(struct entry*));
+        if (p == NULL) {
+            fprintf(stderr, "realloc, no memory\n");
+            return -1;
         }
+        l->entries = p;
+        l->cap = ncap;
     }
-    return;
+
+    l->entries[l->n++] = e;
+    return 0;
 }
 
-static void fstraverse(char* fname, struct flags* f) {
-    if (f->eod) {
-        if (f->sort == 'n')
-            qsort(f->names, f->nidx, sizeof(char*), stringcmp);
-        if (f->sort == 'r')
-            qsort(f->names, f->nidx, sizeof(char*), rev_stringcmp);
-        if (f->deep)
-            printf("%s:\n", f->dir);
-        if (f->format) {
-            // f->bcnt - number of 512B blocks allocated. We're interested in
-            // the number of 1024B blocks allocated.
-            printf("total %lu\n", (unsigned long)f->bcnt / 2);
+/*
+ * sort_listing sorts the entries by integer keys. Names are sorted by their
+ * case-folded 8-byte prefix first, only the runs of equal prefixes are
+ * compared as strings. -t and -S then sort by the mtime or the size, the
+ * radix sort is stable, so the entries with equal keys stay sorted by name.
+ */
+static void sort_listing(struct listing* l, struct flags* f) {
+    if (f->sort == 'd' || l->n < 2)
+        return;
+
+    for (size_t i = 0; i < l->n; i++)
+        l->entries[i]->key = name_key(l->entries[i]->name);
+
+    if (radix_sort(l->entries, l->n) == -1) {
+        qsort(l->entries, l->n, sizeof(struct entry*), keycmp);
+    } else {
+        for (size_t i = 0, j = 1; i < l->n; i = j++) {
+            while (j < l->n && l->entries[j]->key == l->entries[i]->key)
+                j++;
+            if (j - i > 1)
+                qsort(l->entries + i, j - i, sizeof(struct entry*), namecmp);
         }
+    }
 
-        int i = 0;
-        char* name = NULL;
-        while (f->nidx-- > 0) {
-            name = f->names[i++];
-            printf("%s\n", name);
-            free(name);
+    if (f->sort == 't' || f->sort == 'S') {
+        // the newest or the largest first.
+        for (size_t i = 0; i < l->n; i++) {
+            struct entry* e = l->entries[i];
+            uint64_t k = f->sort == 't' ? (uint64_t)e->mtime : (uint64_t)e->size;
+            e->key = ~(k ^ (1ULL << 63));
         }
+        if (radix_sort(l->entries, l->n) == -1)
+            qsort(l->entries, l->n, sizeof(struct entry*), keycmp);
+    }
 
-        f->eod = 0;
-        free(f->names);
-        return;
+    if (f->reverse) {
+        for (size_t i = 0, j = l->n - 1; i < j; i++, j--) {
+            struct entry* e = l->entries[i];
+            l->entries[i] = l->entries[j];
+            l->entries[j] = e;
+        }
     }
+}
 
-    struct stat sb;
-    int bl = strlen(fname) + 1;
-    if (f->dir != NULL) {
-        bl += strlen(f->dir) + 1;
+/*
+ * radix_sort sorts @entries by the key stably, least significant byte first.
+ * The passes where all the keys have the same byte are skipped. Returns -1
+ * if there is no memory for the temporary array.
+ */
+static int radix_sort(struct entry** entries, size_t n) {
+    size_t count[8][256];
+    memset(count, 0, sizeof(count));
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t k = entries[i]->key;
+        for (int b = 0; b < 8; b++)
+            count[b][(k >> (b * 8)) & 0xff]++;
     }
 
-    int cmp = strcmp(fname, ".");
-    if (!cmp) {
-        bl += 1;
+    struct entry** tmp = malloc(n * sizeof(struct entry*));
+    if (tmp == NULL)
+        return -1;
+
+    struct entry** src = entries;
+    struct entry** dst = tmp;
+    for (int b = 0; b < 8; b++) {
+        size_t* c = count[b];
+        if (c[(src[0]->key >> (b * 8)) & 0xff] == n)
+            continue;
+
+        size_t off = 0;
+        for (int i = 0; i < 256; i++) {
+            size_t cnt = c[i];
+            c[i] = off;
+            off += cnt;
+        }
+
+        for (size_t i = 0; i < n; i++)
+            dst[c[(src[i]->key >> (b * 8)) & 0xff]++] = src[i];
+
+        struct entry** t = src;
+        src = dst;
+        dst = t;
     }
 
-    char buf[bl];
-    if (cmp && f->dir != NULL) {
-        strcpy(buf, f->dir);
-        strcat(buf, "/");
-        strcat(buf, fname);
-    } else {
-        strcpy(buf, fname);
+    if (src != entries)
+        memcpy(entries, src, n * sizeof(struct entry*));
+
+    free(tmp);
+    return 0;
+}
+
+/*
+ * name_key packs the first 8 bytes of @name, case-folded, into an integer
+ * which compares as strcasecmp compares the prefixes.
+ */
+static uint64_t name_key(const char* name) {
+    const size_t len = strnlen(name, 8);
+    uint64_t k = 0;
+
+    for (size_t i = 0; i < 8; i++)
+        k = (k << 8) | (i < len ? (unsigned char)tolower((unsigned char)name[i]) : 0);
+
+    return k;
+}
+
+/* needs_meta tells whether every entry has to be stat'ed */
+static int needs_meta(struct flags* f) {
+    return f->format || f->sort == 't' || f->sort == 'S';
+}
+
+static void print_listing(struct listing* l, struct flags* f) {
+    print_header(l, f);
+
+    if (f->format) {
+        blkcnt_t blocks = 0;
+        for (size_t i = 0; i < l->n; i++)
+            blocks += l->entries[i]->blocks;
+        print_total(blocks);
+    }
+
+    print_entries(l, f);
+}
+
+static void print_header(struct listing* l, struct flags* f) {
+    if (f->deep && l->path != NULL) {
+        out_str(l->path, strlen(l->path));
+        out_str(":\n", 2);
     }
+}
 
-    if (stat(buf, &sb) == -1) {
-        fprintf(stderr, "stat(%s): %s\n", buf, strerror(errno));
+/* @blocks is the number of 512B blocks, the total is in 1024B blocks */
+static void print_total(blkcnt_t blocks) {
+    char* p = out_reserve(LINE_PREFIX_MAX);
+    outlen += sprintf(p, "total %lu\n", (unsigned long)blocks / 2);
+}
+
+static void print_entries(struct listing* l, struct flags* f) {
+    if (f->columns) {
+        print_columns(l, f);
         return;
     }
 
-    if (S_ISDIR(sb.st_mode)) {
-        if (f->deep || f->dir == NULL) {
-            struct flags nf;
-            new_flag(f, &nf);
-            nf.dir = buf;
-            dirwalk(&nf, fstraverse);
-            return;
+    for (size_t i = 0; i < l->n; i++) {
+        struct entry* e = l->entries[i];
+        if (e->err != 0) {
+            fprintf(stderr, "stat(%s/%s): %s\n", l->path, e->name, strerror(e->err));
+            continue;
         }
+        print_entry(e, f);
     }
+}
 
-    if (fname[0] == '.')
-        if (!f->dot)
-            return;
+/*
+ * print_columns prints the entries in columns, sorted down the columns. The
+ * number of columns is the largest c such that the c widest entries fit the
+ * terminal side by side: then any c entries fit. It's found in one pass over
+ * a histogram of the widths, the layout never has to be tried.
+ */
+static void print_columns(struct listing* l, struct flags* f) {
+    const size_t sep = 2;
+    const size_t tw = f->width;
+    size_t n = 0;
 
-    if (f->nsize == 0) {
-        // it's a first time, need to alloc some memory
-        char** names = (char**)malloc(sizeof(char*));
-        if (names == NULL) { /* handle the malloc error */
+    // the entries that can't be stat'ed are reported and dropped, the order
+    // of the rest is kept.
+    for (size_t i = 0; i < l->n; i++) {
+        struct entry* e = l->entries[i];
+        if (e->err != 0) {
+            fprintf(stderr, "stat(%s/%s): %s\n", l->path, e->name, strerror(e->err));
+            continue;
         }
-        f->names = names;
-        f->nsize = 1;
+        e->width = entry_width(e, f);
+        l->entries[n++] = e;
+    }
+    l->n = n;
+    if (n == 0)
+        return;
+
+    size_t* hist = calloc(tw + 1, sizeof(size_t));
+    if (hist == NULL) {
+        fprintf(stderr, "calloc, no memory\n");
+        for (size_t i = 0; i < n; i++)
+            print_entry(l->entries[i], f);
+        return;
+    }
+
+    size_t maxw = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t w = l->entries[i]->width < tw ? l->entries[i]->width : tw;
+        hist[w]++;
+        if (w > maxw)
+            maxw = w;
     }
 
-    if (f->nidx >= f->nsize) { /* grow the array of file names */
-        size_t nsz = f->nsize * 2;
-        char** names = (char**)realloc(f->names, nsz * sizeof(char*));
-        if (names == NULL) { /* handle the realloc error */
+    // take the widest entries while they fit: c entries take their widths
+    // plus c - 1 separators.
+    size_t cols = 0;
+    size_t used = 0;
+    for (size_t w = maxw; w > 0 && cols < n; w--) {
+        if (hist[w] == 0)
+            continue;
+
+        size_t fit = used + w > tw ? 0 : (tw - used - w) / (w + sep) + 1;
+        size_t take = hist[w] < fit ? hist[w] : fit;
+        cols += take;
+        used += take * (w + sep);
+        if (take < hist[w])
+            break;
+    }
+    free(hist);
+
+    if (cols == 0)
+        cols = 1;
+    if (cols > n)
+        cols = n;
+    const size_t rows = (n + cols - 1) / cols;
+    cols = (n + rows - 1) / rows;
+
+    size_t* colw = calloc(cols, sizeof(size_t));
+    if (colw == NULL) {
+        fprintf(stderr, "calloc, no memory\n");
+        for (size_t i = 0; i < n; i++)
+            print_entry(l->entries[i], f);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (l->entries[i]->width > colw[i / rows])
+            colw[i / rows] = l->entries[i]->width;
+    }
+
+    for (size_t r = 0; r < rows; r++) {
+        for (size_t c = 0; c < cols; c++) {
+            size_t i = c * rows + r;
+            if (i >= n)
+                break;
+
+            struct entry* e = l->entries[i];
+            if (f->inode) {
+                char* p = out_reserve(LINE_PREFIX_MAX);
+                outlen += sprintf(p, "%lu ", (unsigned long)e->ino);
+            }
+            out_str(e->name, strlen(e->name));
+
+            // no padding after the last column of the row.
+            if (c + 1 < cols && i + rows < n) {
+                for (size_t pad = colw[c] - e->width + sep; pad > 0;) {
+                    size_t k = pad < LINE_PREFIX_MAX ? pad : LINE_PREFIX_MAX;
+                    memset(out_reserve(k), ' ', k);
+                    outlen += k;
+                    pad -= k;
+                }
+            }
         }
-        f->names = names;
-        f->nsize = nsz;
+        out_str("\n", 1);
     }
 
-    char* name = NULL;
+    free(colw);
+}
+
+/* entry_width is the number of terminal columns taken by @e in a column */
+static size_t entry_width(struct entry* e, struct flags* f) {
+    size_t w = 0;
+
+    // UTF-8 continuation bytes don't take a column.
+    for (const unsigned char* p = (const unsigned char*)e->name; *p != '\0'; p++)
+        w += (*p & 0xc0) != 0x80;
+
+    if (f->inode) {
+        char buf[32];
+        w += snprintf(buf, sizeof(buf), "%lu ", (unsigned long)e->ino);
+    }
+
+    return w;
+}
+
+static int term_width(void) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        return ws.ws_col;
+
+    const char* cols = getenv("COLUMNS");
+    if (cols != NULL && atoi(cols) > 0)
+        return atoi(cols);
+
+    return 80;
+}
+
+static void print_entry(struct entry* e, struct flags* f) {
+    char* p = out_reserve(LINE_PREFIX_MAX);
+    char* start = p;
+
+    if (f->inode)
+        p += sprintf(p, "%lu ", (unsigned long)e->ino);
+
     if (f->format) {
-        name = (char*)malloc(BUFSIZ);
-        if (name == NULL) { /* handle the malloc error */
+        char smode[11];
+        mode_to_str(e->mode, smode);
+
+        // user and group names are cut, so the line fits the reserved space.
+        p += sprintf(p, "%s %4lu %-8.64s %-8.64s %8ld ", smode, (unsigned long)e->nlink,
+                     uid_to_name(e->uid), gid_to_name(e->gid), (long)e->size);
+        format_time(e->mtime, p);
+        p += TIME_LEN;
+        *p++ = ' ';
+    }
+
+    outlen += p - start;
+    out_str(e->name, strlen(e->name));
+    out_str("\n", 1);
+}
+
+/*
+ * stat_entries fetches the metadata of @entries relative to the directory
+ * @dirfd: of all of them if @all is set, else of the ones of an unknown type.
+ * Only the calling thread stats them unless @parallel is set.
+ */
+static void
+stat_entries(int dirfd, int all, struct entry** entries, size_t n, int parallel) {
+    struct stat_batch b = { dirfd, all, entries, n, 0 };
+    pthread_t thrds[STAT_THREADS];
+
+    size_t want = 0;
+    for (size_t i = 0; i < n; i++)
+        want += all || entries[i]->type == DT_UNKNOWN;
+
+    size_t nthr = parallel ? want / STAT_PER_THREAD : 1;
+    if (nthr > STAT_THREADS)
+        nthr = STAT_THREADS;
+
+    // the calling thread is a worker too, a failed pthread_create just
+    // leaves it more work.
+    size_t started = 0;
+    for (; started + 1 < nthr; started++) {
+        if (pthread_create(&thrds[started], NULL, stat_worker, &b) != 0)
+            break;
+    }
+
+    stat_worker(&b);
+
+    for (size_t i = 0; i < started; i++)
+        pthread_join(thrds[i], NULL);
+}
+
+static void* stat_worker(void* p) {
+    struct stat_batch* b = (struct stat_batch*)p;
+    struct stat sb;
+
+    for (;;) {
+        size_t i = __atomic_fetch_add(&b->next, STAT_BATCH, __ATOMIC_RELAXED);
+        if (i >= b->n)
+            break;
+
+        size_t end = i + STAT_BATCH < b->n ? i + STAT_BATCH : b->n;
+        for (; i < end; i++) {
+            struct entry* e = b->entries[i];
+            if (!b->all && e->type != DT_UNKNOWN)
+                continue;
+
+            // learn the type first, -R must not descend into a symlink even
+            // though its metadata is the one of the target.
+            if (e->type == DT_UNKNOWN) {
+                if (fstatat(b->dirfd, e->name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+                    e->err = errno;
+                    continue;
+                }
+                e->type = IFTODT(sb.st_mode);
+                if (e->type != DT_LNK) {
+                    stat_to_entry(&sb, e);
+                    continue;
+                }
+            }
+
+            if (fstatat(b->dirfd, e->name, &sb, 0) == -1)
+                e->err = errno;
+            else
+                stat_to_entry(&sb, e);
         }
-        finfo(f->inode, name, fname, &sb);
-    } else {
-        if (f->inode) {
-            static const int max_inode_num_cnt = 20;
-            int len = strlen(fname) + 1 + max_inode_num_cnt;
-            name = (char*)malloc(len);
-            if (name == NULL) { /* handle the malloc error */
+    }
+
+    return NULL;
+}
+
+static void stat_to_entry(struct stat* sb, struct entry* e) {
+    e->ino = sb->st_ino;
+    e->size = sb->st_size;
+    e->mtime = sb->st_mtime;
+    e->blocks = sb->st_blocks;
+    e->nlink = sb->st_nlink;
+    e->uid = sb->st_uid;
+    e->gid = sb->st_gid;
+    e->mode = sb->st_mode;
+}
+
+/* is_dir tells whether -R has to descend into @e, symlinks are not followed */
+static int is_dir(struct entry* e) {
+    return e->type == DT_DIR;
+}
+
+/* tree_walk lists the tree at @path for -R */
+static void tree_walk(char* path, struct flags* f) {
+    struct tree t;
+    pthread_t thrds[TREE_THREADS];
+    int ret = 0;
+
+    memset(&t, 0, sizeof(t));
+    t.f = f;
+    if ((ret = pthread_mutex_init(&t.lock, NULL)) != 0
+        || (ret = pthread_cond_init(&t.work, NULL)) != 0
+        || (ret = pthread_cond_init(&t.ready, NULL)) != 0) {
+        fprintf(stderr, "pthread_init: %s\n", strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+
+    struct dirnode* root = new_node(NULL, path);
+    if (root == NULL)
+        return;
+    root->state = NODE_READING;
+
+    // the sequencer reads whatever isn't taken, the walk works without any
+    // worker too.
+    int started = 0;
+    for (; started < TREE_THREADS; started++) {
+        if (pthread_create(&thrds[started], NULL, tree_worker, &t) != 0)
+            break;
+    }
+
+    read_node(&t, root);
+    tree_print(&t, root);
+
+    pthread_mutex_lock(&t.lock);
+    t.stop = 1;
+    pthread_cond_broadcast(&t.work);
+    pthread_mutex_unlock(&t.lock);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(thrds[i], NULL);
+
+    free(t.stack);
+    pthread_cond_destroy(&t.ready);
+    pthread_cond_destroy(&t.work);
+    pthread_mutex_destroy(&t.lock);
+}
+
+static void* tree_worker(void* p) {
+    struct tree* t = (struct tree*)p;
+
+    pthread_mutex_lock(&t->lock);
+    for (;;) {
+        if (t->stop)
+            break;
+        if (t->n == 0 || t->ahead >= TREE_AHEAD) {
+            pthread_cond_wait(&t->work, &t->lock);
+            continue;
+        }
+
+        struct dirnode* node = t->stack[--t->n];
+        node->state = NODE_READING;
+        pthread_mutex_unlock(&t->lock);
+
+        read_node(t, node);
+
+        pthread_mutex_lock(&t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+
+/*
+ * tree_print prints @node and the subtrees of its subdirectories, waiting for
+ * them to be read (or reading them). The nodes are freed once printed.
+ */
+static void tree_print(struct tree* t, struct dirnode* node) {
+    pthread_mutex_lock(&t->lock);
+    if (node->state == NODE_QUEUED) {
+        // it's usually close to the top, the first subdirectory is pushed last.
+        for (size_t i = t->n; i > 0; i--) {
+            if (t->stack[i - 1] == node) {
+                memmove(&t->stack[i - 1], &t->stack[i],
+                        (t->n - i) * sizeof(struct dirnode*));
+                t->n--;
+                break;
             }
-            sprintf(name, "%lu %s", (unsigned long)sb.st_ino, fname);
+        }
+        node->state = NODE_READING;
+        pthread_mutex_unlock(&t->lock);
+        read_node(t, node);
+        pthread_mutex_lock(&t->lock);
+    }
+    while (node->state != NODE_READY)
+        pthread_cond_wait(&t->ready, &t->lock);
+    pthread_mutex_unlock(&t->lock);
+
+    if (node->err != 0)
+        fprintf(stderr, "opendir(%s): %s\n", node->path, strerror(node->err));
+    if (node->close_err != 0)
+        fprintf(stderr, "closedir(%s): %s\n", node->path, strerror(node->close_err));
+    if (node->ok)
+        print_listing(&node->l, t->f);
+
+    // the entries aren't needed anymore, only the subdirectories are.
+    free(node->l.entries);
+    node->l.entries = NULL;
+    arena_free(&node->mem);
+
+    pthread_mutex_lock(&t->lock);
+    t->ahead--;
+    pthread_cond_broadcast(&t->work);
+    pthread_mutex_unlock(&t->lock);
+
+    for (size_t i = 0; i < node->nsubdirs; i++)
+        tree_print(t, node->subdirs[i]);
+
+    free_node(node);
+}
+
+/*
+ * read_node reads, stats and sorts the entries of @node, then pushes the
+ * nodes of its subdirectories to the stack.
+ */
+static void read_node(struct tree* t, struct dirnode* node) {
+    struct flags* f = t->f;
+    struct dirstream d;
+
+    if (dir_open(&d, node->path) == -1) {
+        node->err = errno;
+    } else {
+        int ret = read_entries(&d, &node->l, &node->mem, f, SIZE_MAX);
+        // the tree workers already overlap their stats, a thread pool of
+        // every worker would multiply the threads.
+        if (ret == 0) {
+            stat_entries(dir_fd(&d), needs_meta(f), node->l.entries, node->l.n, 0);
+            sort_listing(&node->l, f);
+            node->ok = 1;
+        }
+
+        if (dir_close(&d) == -1)
+            node->close_err = errno;
+    }
+
+    size_t nsub = 0;
+    for (size_t i = 0; node->ok && i < node->l.n; i++) {
+        struct entry* e = node->l.entries[i];
+        nsub += e->err == 0 && is_dir(e);
+    }
+
+    if (nsub > 0 && (node->subdirs = calloc(nsub, sizeof(struct dirnode*))) == NULL) {
+        fprintf(stderr, "calloc, no memory\n");
+        nsub = 0;
+    }
+
+    for (size_t i = 0; node->nsubdirs < nsub && i < node->l.n; i++) {
+        struct entry* e = node->l.entries[i];
+        if (e->err != 0 || !is_dir(e))
+            continue;
+
+        struct dirnode* sub = new_node(node->path, e->name);
+        if (sub == NULL)
+            break;
+        node->subdirs[node->nsubdirs++] = sub;
+    }
+
+    pthread_mutex_lock(&t->lock);
+
+    if (t->n + node->nsubdirs > t->cap) {
+        size_t ncap = t->cap == 0 ? 64 : t->cap;
+        while (ncap < t->n + node->nsubdirs)
+            ncap *= 2;
+        struct dirnode** p = realloc(t->stack, ncap * sizeof(struct dirnode*));
+        if (p == NULL) {
+            // the sequencer reads the subdirectories itself.
+            fprintf(stderr, "realloc, no memory\n");
         } else {
-            name = (char*)malloc(strlen(fname) + 1);
-            if (name == NULL) { /* handle the malloc error */
+            t->stack = p;
+            t->cap = ncap;
+        }
+    }
+    for (size_t i = node->nsubdirs; i > 0 && t->n < t->cap; i--)
+        t->stack[t->n++] = node->subdirs[i - 1];
+
+    node->state = NODE_READY;
+    t->ahead++;
+    pthread_cond_broadcast(&t->ready);
+    if (node->nsubdirs > 0)
+        pthread_cond_broadcast(&t->work);
+
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* new_node makes the node of @dir/@name, of @name if @dir is NULL */
+static struct dirnode* new_node(const char* dir, const char* name) {
+    struct dirnode* node = calloc(1, sizeof(struct dirnode));
+    if (node == NULL) {
+        fprintf(stderr, "calloc, no memory\n");
+        return NULL;
+    }
+
+    size_t dl = dir != NULL ? strlen(dir) + 1 : 0;
+    size_t nl = strlen(name);
+    if ((node->path = malloc(dl + nl + 1)) == NULL) {
+        fprintf(stderr, "malloc, no memory\n");
+        free(node);
+        return NULL;
+    }
+    if (dir != NULL) {
+        memcpy(node->path, dir, dl - 1);
+        node->path[dl - 1] = '/';
+    }
+    memcpy(node->path + dl, name, nl + 1);
+
+    node->l.path = node->path;
+    node->state = NODE_QUEUED;
+    arena_init(&node->mem, NODE_ARENA_BLOCK_SIZE);
+    return node;
+}
+
+static void free_node(struct dirnode* node) {
+    free(node->subdirs);
+    free(node->path);
+    free(node);
+}
+
+/* du_walk prints the disk usage of the tree at @path for -D */
+static void du_walk(char* path) {
+    struct du du;
+    pthread_t thrds[TREE_THREADS];
+    int ret = 0;
+
+    memset(&du, 0, sizeof(du));
+    if ((ret = pthread_mutex_init(&du.lock, NULL)) != 0
+        || (ret = pthread_cond_init(&du.work, NULL)) != 0) {
+        fprintf(stderr, "pthread_init: %s\n", strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+
+    struct dunode* root = calloc(1, sizeof(struct dunode));
+    if (root == NULL || (root->path = strdup(path)) == NULL) {
+        fprintf(stderr, "calloc, no memory\n");
+        free(root);
+        return;
+    }
+    if (du_push(&du, root) == -1) {
+        free(root->path);
+        free(root);
+        return;
+    }
+
+    int started = 0;
+    for (; started < TREE_THREADS; started++) {
+        if (pthread_create(&thrds[started], NULL, du_worker, &du) != 0)
+            break;
+    }
+
+    du_worker(&du);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(thrds[i], NULL);
+
+    struct inode_set seen;
+    memset(&seen, 0, sizeof(seen));
+    du_sum(root, &seen);
+    du_print(root);
+
+    free(seen.slots);
+    free(du.stack);
+    pthread_cond_destroy(&du.work);
+    pthread_mutex_destroy(&du.lock);
+}
+
+static void* du_worker(void* p) {
+    struct du* du = (struct du*)p;
+
+    pthread_mutex_lock(&du->lock);
+    for (;;) {
+        if (du->active == 0)
+            break;
+        if (du->n == 0) {
+            pthread_cond_wait(&du->work, &du->lock);
+            continue;
+        }
+
+        struct dunode* node = du->stack[--du->n];
+        pthread_mutex_unlock(&du->lock);
+
+        du_read(du, node);
+
+        pthread_mutex_lock(&du->lock);
+        if (--du->active == 0)
+            pthread_cond_broadcast(&du->work);
+    }
+    pthread_mutex_unlock(&du->lock);
+
+    return NULL;
+}
+
+/*
+ * du_read sums up the blocks of @node and of its files, and pushes its
+ * subdirectories to the stack.
+ */
+static void du_read(struct du* du, struct dunode* node) {
+    struct dirstream d;
+    struct dentry de;
+    struct stat sb;
+    size_t cap = 0;
+    size_t lcap = 0;
+    int ret = 0;
+
+    // a subdirectory is opened in its parent, a symlink swapped in for it
+    // isn't followed. The parent is closed by its last subdirectory.
+    struct dunode* parent = node->parent;
+    if (parent == NULL || parent->fd == -1)
+        ret = dir_open(&d, node->path);
+    else
+        ret = dir_openat(&d, parent->fd, node->name);
+    if (ret == -1)
+        fprintf(stderr, "opendir(%s): %s\n", node->path, strerror(errno));
+    if (parent != NULL && parent->fd != -1
+        && __atomic_sub_fetch(&parent->unread, 1, __ATOMIC_ACQ_REL) == 0)
+        close(parent->fd);
+    if (ret == -1)
+        return;
+
+    node->fd = -1;
+    const int fd = dir_fd(&d);
+    if (fstat(fd, &sb) == 0)
+        node->blocks += sb.st_blocks;
+
+    while ((ret = dir_next(&d, &de)) > 0) {
+        if (strcmp(de.name, ".") == 0 || strcmp(de.name, "..") == 0)
+            continue;
+
+        if (de.type != DT_DIR) {
+            if (fstatat(fd, de.name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+                fprintf(stderr, "stat(%s/%s): %s\n", node->path, de.name, strerror(errno));
+                continue;
+            }
+            if (!S_ISDIR(sb.st_mode) && sb.st_nlink < 2) {
+                node->blocks += sb.st_blocks;
+                continue;
+            }
+            if (!S_ISDIR(sb.st_mode)) {
+                if (node->nlinks == lcap) {
+                    size_t ncap = lcap == 0 ? 8 : lcap * 2;
+                    struct dulink* p = realloc(node->links, ncap * sizeof(struct dulink));
+                    if (p == NULL) {
+                        // without memory the file is counted every time it's met.
+                        node->blocks += sb.st_blocks;
+                        continue;
+                    }
+                    node->links = p;
+                    lcap = ncap;
+                }
+                struct dulink* l = &node->links[node->nlinks++];
+                l->dev = sb.st_dev;
+                l->ino = sb.st_ino;
+                l->blocks = sb.st_blocks;
+                continue;
             }
-            sprintf(name, "%s", fname);
         }
+
+        struct dunode* sub = calloc(1, sizeof(struct dunode));
+        size_t pl = strlen(node->path);
+        size_t nl = strlen(de.name);
+        if (sub == NULL || (sub->path = malloc(pl + nl + 2)) == NULL) {
+            fprintf(stderr, "malloc, no memory\n");
+            free(sub);
+            continue;
+        }
+        memcpy(sub->path, node->path, pl);
+        sub->path[pl] = '/';
+        memcpy(sub->path + pl + 1, de.name, nl + 1);
+        sub->name = sub->path + pl + 1;
+        sub->parent = node;
+
+        if (node->nsubdirs == cap) {
+            size_t ncap = cap == 0 ? 8 : cap * 2;
+            struct dunode** p = realloc(node->subdirs, ncap * sizeof(struct dunode*));
+            if (p == NULL) {
+                fprintf(stderr, "realloc, no memory\n");
+                free(sub->path);
+                free(sub);
+                continue;
+            }
+            node->subdirs = p;
+            cap = ncap;
+        }
+        node->subdirs[node->nsubdirs++] = sub;
+    }
+
+    if (ret == -1)
+        fprintf(stderr, "readdir(%s): %s\n", node->path, strerror(errno));
+
+    // without a spare descriptor the subdirectories are opened by the path.
+    if (node->nsubdirs > 0) {
+        node->unread = node->nsubdirs;
+        node->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
     }
-    f->names[f->nidx++] = name;
-    f->bcnt += sb.st_blocks;
+    if (dir_close(&d) == -1)
+        fprintf(stderr, "closedir(%s): %s\n", node->path, strerror(errno));
 
-    // ls <filename>
-    if (f->dir == NULL) {
-        f->eod = 1;
-        fstraverse(NULL, f);
+    // the output order doesn't depend on the directory order.
+    qsort(node->subdirs, node->nsubdirs, sizeof(struct dunode*), dunode_cmp);
+
+    size_t pushed = 0;
+    for (; pushed < node->nsubdirs; pushed++) {
+        if (du_push(du, node->subdirs[pushed]) == -1)
+            break;
     }
+
+    // the subdirectories that didn't fit the stack are read right here.
+    for (size_t i = pushed; i < node->nsubdirs; i++)
+        du_read(du, node->subdirs[i]);
 }
 
-static void finfo(int print_inode, char* buf, char* name, struct stat* sb) {
-    static char smode[11];
-    mode_to_str(sb->st_mode, smode);
+static int du_push(struct du* du, struct dunode* node) {
+    int ret = 0;
 
-    if (print_inode) {
-        sprintf(buf, "%lu %s %4lu %-8s %-8s %8ld %.12s %s", (unsigned long)sb->st_ino,
-                smode, (unsigned long)sb->st_nlink, uid_to_name(sb->st_uid),
-                gid_to_name(sb->st_gid), (unsigned long)sb->st_size,
-                4 + ctime(&sb->st_mtime), name);
-    } else {
-        sprintf(buf, "%s %4lu %-8s %-8s %8ld %.12s %s", smode,
-                (unsigned long)sb->st_nlink, uid_to_name(sb->st_uid),
-                gid_to_name(sb->st_gid), (unsigned long)sb->st_size,
-                4 + ctime(&sb->st_mtime), name);
+    pthread_mutex_lock(&du->lock);
+    if (du->n == du->cap) {
+        size_t ncap = du->cap == 0 ? 64 : du->cap * 2;
+        struct dunode** p = realloc(du->stack, ncap * sizeof(struct dunode*));
+        if (p == NULL) {
+            fprintf(stderr, "realloc, no memory\n");
+            ret = -1;
+            goto out;
+        }
+        du->stack = p;
+        du->cap = ncap;
+    }
+
+    du->stack[du->n++] = node;
+    du->active++;
+    pthread_cond_signal(&du->work);
+
+out:
+    pthread_mutex_unlock(&du->lock);
+    return ret;
+}
+
+/*
+ * du_sum counts the files with several links of @node subtree at their first
+ * place in the pre-order and sums up the subtree blocks.
+ */
+static void du_sum(struct dunode* node, struct inode_set* seen) {
+    for (size_t i = 0; i < node->nlinks; i++) {
+        struct dulink* l = &node->links[i];
+        if (first_link(seen, l->dev, l->ino))
+            node->blocks += l->blocks;
+    }
+
+    for (size_t i = 0; i < node->nsubdirs; i++) {
+        du_sum(node->subdirs[i], seen);
+        node->blocks += node->subdirs[i]->blocks;
+    }
+}
+
+/* du_print prints the usage of @node subtree in the post-order and frees it */
+static void du_print(struct dunode* node) {
+    for (size_t i = 0; i < node->nsubdirs; i++)
+        du_print(node->subdirs[i]);
+
+    char* p = out_reserve(LINE_PREFIX_MAX);
+    outlen += sprintf(p, "%lu\t", (unsigned long)node->blocks / 2);
+    out_str(node->path, strlen(node->path));
+    out_str("\n", 1);
+
+    free(node->links);
+    free(node->subdirs);
+    free(node->path);
+    free(node);
+}
+
+/*
+ * first_link tells whether the file (@dev, @ino) is met for the first time,
+ * it's remembered in @s then.
+ */
+static int first_link(struct inode_set* s, dev_t dev, ino_t ino) {
+    if (hash_full(s->len, s->cap)) {
+        struct inode_set old = *s;
+        s->cap = old.cap == 0 ? 256 : old.cap * 2;
+        if ((s->slots = calloc(s->cap, sizeof(struct inode_key))) == NULL) {
+            // without memory the file is counted every time it's met.
+            *s = old;
+            return 1;
+        }
+
+        for (size_t i = 0; i < old.cap; i++) {
+            if (!old.slots[i].used)
+                continue;
+            size_t j = hash_slot(hash_inode(old.slots[i].dev, old.slots[i].ino), s->cap);
+            while (s->slots[j].used)
+                j = hash_next(j, s->cap);
+            s->slots[j] = old.slots[i];
+        }
+        free(old.slots);
+    }
+
+    size_t i = hash_slot(hash_inode(dev, ino), s->cap);
+    for (; s->slots[i].used; i = hash_next(i, s->cap)) {
+        if (s->slots[i].ino == ino && s->slots[i].dev == dev)
+            return 0;
+    }
+
+    s->slots[i].dev = dev;
+    s->slots[i].ino = ino;
+    s->slots[i].used = 1;
+    s->len++;
+    return 1;
+}
+
+static int dunode_cmp(const void* p1, const void* p2) {
+    const struct dunode* n1 = *((struct dunode**)p1);
+    const struct dunode* n2 = *((struct dunode**)p2);
+    return strcmp(n1->path, n2->path);
+}
+
+static void out_flush(void) {
+    size_t off = 0;
+    while (off < outlen) {
+        ssize_t n = write(STDOUT_FILENO, outbuf + off, outlen - off);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        off += n;
+    }
+    outlen = 0;
+}
+
+/*
+ * out_reserve returns the place for at most @n (<= OUTBUF_SIZE) more bytes
+ * of the output, the caller advances outlen by the bytes it wrote.
+ */
+static char* out_reserve(size_t n) {
+    if (outlen + n > OUTBUF_SIZE)
+        out_flush();
+    return outbuf + outlen;
+}
+
+static void out_str(const char* s, size_t n) {
+    while (n > 0) {
+        if (outlen == OUTBUF_SIZE)
+            out_flush();
+
+        size_t len = OUTBUF_SIZE - outlen < n ? OUTBUF_SIZE - outlen : n;
+        memcpy(outbuf + outlen, s, len);
+        outlen += len;
+        s += len;
+        n -= len;
+    }
+}
+
+#ifdef __linux__
+/* dir_init sets @d up to read the directory @fd, -1 is passed through */
+static int dir_init(struct dirstream* d, int fd) {
+    d->len = 0;
+    d->pos = 0;
+    if ((d->fd = fd) == -1)
+        return -1;
+
+    if ((d->buf = malloc(DIRBUF_SIZE)) == NULL) {
+        close(d->fd);
+        errno = ENOMEM;
+        return -1;
     }
+
+    return 0;
+}
+
+static int dir_open(struct dirstream* d, const char* path) {
+    return dir_init(d, open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+}
+
+/* dir_openat opens @name of the directory @dirfd, a symlink isn't followed */
+static int dir_openat(struct dirstream* d, int dirfd, const char* name) {
+    const int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    return dir_init(d, openat(dirfd, name, flags));
+}
+
+/*
+ * dir_next stores the next entry of @d in @e, the name is valid until the
+ * next call. Returns 1 on success, 0 at the end of the directory and -1 in
+ * case of the error.
+ */
+static int dir_next(struct dirstream* d, struct dentry* e) {
+    if (d->pos >= d->len) {
+        long n = syscall(SYS_getdents64, d->fd, d->buf, DIRBUF_SIZE);
+        if (n <= 0)
+            return n == 0 ? 0 : -1;
+        d->len = n;
+        d->pos = 0;
+    }
+
+    struct linux_dirent64* dp = (struct linux_dirent64*)(d->buf + d->pos);
+    d->pos += dp->d_reclen;
+
+    e->name = dp->d_name;
+    e->type = dp->d_type;
+    e->ino = dp->d_ino;
+    return 1;
+}
+
+static int dir_close(struct dirstream* d) {
+    free(d->buf);
+    return close(d->fd);
+}
+
+static int dir_fd(struct dirstream* d) {
+    return d->fd;
+}
+#else
+static int dir_open(struct dirstream* d, const char* path) {
+    return (d->dir = opendir(path)) == NULL ? -1 : 0;
+}
+
+static int dir_openat(struct dirstream* d, int dirfd, const char* name) {
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    if ((d->dir = fdopendir(fd)) == NULL) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static int dir_next(struct dirstream* d, struct dentry* e) {
+    errno = 0;
+    struct dirent* dp = readdir(d->dir);
+    if (dp == NULL)
+        return errno == 0 ? 0 : -1;
+
+    e->name = dp->d_name;
+#ifdef DT_UNKNOWN
+    e->type = dp->d_type;
+#else
+    e->type = DT_UNKNOWN;
+#endif
+    e->ino = dp->d_ino;
+    return 1;
+}
+
+static int dir_close(struct dirstream* d) {
+    return closedir(d->dir);
+}
+
+static int dir_fd(struct dirstream* d) {
+    return dirfd(d->dir);
+}
+#endif
+
+/* format_time writes TIME_LEN characters of @t to @buf, no terminating NUL */
+static void format_time(time_t t, char* buf) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm tm;
+
+    long slot = (long)(t / 86400) % DAY_CACHE_SIZE;
+    struct day* d = &days[slot < 0 ? slot + DAY_CACHE_SIZE : slot];
+
+    if (!d->valid || t < d->start || t - d->start >= 86400) {
+        if (localtime_r(&t, &tm) == NULL) {
+            memcpy(buf, "??? ?? ??:??", TIME_LEN);
+            return;
+        }
+
+        char date[8];
+        snprintf(date, sizeof(date), "%.3s %2d ", months + tm.tm_mon * 3, tm.tm_mday);
+
+        // the day is cached if it runs from 00:00 to 23:59 in 24 hours.
+        struct day nd;
+        nd.start = t - (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec);
+        memcpy(nd.date, date, sizeof(nd.date));
+
+        time_t last = nd.start + 86399;
+        struct tm first, end;
+        nd.valid = localtime_r(&nd.start, &first) != NULL && first.tm_mday == tm.tm_mday
+            && first.tm_hour == 0 && first.tm_min == 0 && first.tm_sec == 0
+            && localtime_r(&last, &end) != NULL && end.tm_mday == tm.tm_mday
+            && end.tm_hour == 23 && end.tm_min == 59 && end.tm_sec == 59;
+
+        if (!nd.valid) {
+            char tbuf[TIME_LEN + 1];
+            snprintf(tbuf, sizeof(tbuf), "%s%02d:%02d", date, tm.tm_hour, tm.tm_min);
+            memcpy(buf, tbuf, TIME_LEN);
+            return;
+        }
+        *d = nd;
+    }
+
+    long secs = (long)(t - d->start);
+    int hh = secs / 3600;
+    int mm = secs / 60 % 60;
+
+    memcpy(buf, d->date, sizeof(d->date));
+    buf[7] = '0' + hh / 10;
+    buf[8] = '0' + hh % 10;
+    buf[9] = ':';
+    buf[10] = '0' + mm / 10;
+    buf[11] = '0' + mm % 10;
 }
 
 static void mode_to_str(mode_t m, char* buf) {
@@ -329,39 +1813,99 @@ static void mode_to_str(mode_t m, char* buf) {
         buf[9] = 't';
 }
 
-static char* uid_to_name(uid_t uid) {
-    static char numstr[10];
+static const char* uid_to_name(uid_t uid) {
+    char numstr[16];
     struct passwd* pp = NULL;
 
+    struct id_name* n = id_lookup(&users, uid);
+    if (n != NULL && n->name != NULL)
+        return n->name;
+
     if ((pp = getpwuid(uid)) == NULL) {
-        sprintf(numstr, "%d", uid);
-        return numstr;
+        sprintf(numstr, "%u", (unsigned)uid);
+        return id_put(&users, uid, numstr);
     }
 
-    return pp->pw_name;
+    return id_put(&users, uid, pp->pw_name);
 }
 
-static char* gid_to_name(gid_t gid) {
-    static char numstr[10];
+static const char* gid_to_name(gid_t gid) {
+    char numstr[16];
     struct group* gp = NULL;
 
+    struct id_name* n = id_lookup(&groups, gid);
+    if (n != NULL && n->name != NULL)
+        return n->name;
+
     if ((gp = getgrgid(gid)) == NULL) {
-        sprintf(numstr, "%d", gid);
-        return numstr;
+        sprintf(numstr, "%u", (unsigned)gid);
+        return id_put(&groups, gid, numstr);
     }
 
-    return gp->gr_name;
+    return id_put(&groups, gid, gp->gr_name);
+}
+
+/*
+ * id_lookup returns the slot of @id or the empty slot where it would be
+ * placed, NULL if the table isn't allocated yet.
+ */
+static struct id_name* id_lookup(struct id_cache* c, unsigned id) {
+    if (c->cap == 0)
+        return NULL;
+
+    size_t i = hash_slot(id, c->cap);
+    while (c->slots[i].name != NULL && c->slots[i].id != id)
+        i = hash_next(i, c->cap);
+
+    return &c->slots[i];
+}
+
+/*
+ * id_put caches @name of @id and returns the cached copy. Without memory the
+ * name is not cached, it's returned as is (getpw* and getgr* keep it valid
+ * until the next call, which is enough for one line).
+ */
+static const char* id_put(struct id_cache* c, unsigned id, const char* name) {
+    static char fallback[64];
+
+    if (hash_full(c->len, c->cap)) {
+        struct id_cache old = *c;
+        c->cap = old.cap == 0 ? 16 : old.cap * 2;
+        if ((c->slots = calloc(c->cap, sizeof(struct id_name))) == NULL) {
+            *c = old;
+            goto nomem;
+        }
+
+        for (size_t i = 0; i < old.cap; i++) {
+            if (old.slots[i].name != NULL)
+                *id_lookup(c, old.slots[i].id) = old.slots[i];
+        }
+        free(old.slots);
+    }
+
+    struct id_name* n = id_lookup(c, id);
+    if ((n->name = strdup(name)) == NULL)
+        goto nomem;
+    n->id = id;
+    c->len++;
+    return n->name;
+
+nomem:
+    snprintf(fallback, sizeof(fallback), "%s", name);
+    return fallback;
 }
 
-// p1, p2 in the realiaty are `char **`, strcasecmp expects to get const char *
-static int stringcmp(const void* p1, const void* p2) {
-    const char* s1 = *((char**)p1);
-    const char* s2 = *((char**)p2);
-    return strcasecmp(s1, s2);
+// p1, p2 in the realiaty are `struct entry **`
+static int namecmp(const void* p1, const void* p2) {
+    const struct entry* e1 = *((struct entry**)p1);
+    const struct entry* e2 = *((struct entry**)p2);
+    return strcasecmp(e1->name, e2->name);
 }
 
-static int rev_stringcmp(const void* p1, const void* p2) {
-    char* s1 = *((char**)p1);
-    char* s2 = *((char**)p2);
-    return strcasecmp(s2, s1);
+static int keycmp(const void* p1, const void* p2) {
+    const struct entry* e1 = *((struct entry**)p1);
+    const struct entry* e2 = *((struct entry**)p2);
+    if (e1->key != e2->key)
+        return e1->key < e2->key ? -1 : 1;
+    return strcasecmp(e1->name, e2->name);
 }
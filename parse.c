@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "parse.h"
+
+enum token_type { TOK_WORD, TOK_PIPE, TOK_SEMI, TOK_AMP, TOK_END };
+
+struct token {
+    enum token_type type;
+    char* text;
+    int quoted; /* a quoted word is never a keyword */
+};
+
+struct lexer {
+    const char* p;
+    struct arena* mem;
+};
+
+struct word {
+    char* text;
+    struct word* next;
+};
+
+enum { PART_COND, PART_THEN, PART_ELSE };
+
+/* parse_frame is an if node whose fi wasn't seen yet */
+struct parse_frame {
+    struct node* node;
+    struct node** tail; /* where the next node of the current part goes */
+    int part;
+    struct parse_frame* up;
+};
+
+static int next_token(struct lexer* lx, struct token* t);
+static const char* word_end(const char* p);
+static char* unquote(struct arena* mem, const char* p, const char* end);
+
+static int
+parse_pipeline(struct parser* p, struct lexer* lx, struct token* t, struct node** out);
+static int parse_keyword(struct parser* p, const struct token* t);
+static int is_keyword(const struct token* t);
+static void append(struct parser* p, struct node* n);
+static struct node* new_node(struct parser* p, enum node_type type);
+static int syntax_error(struct parser* p, const struct token* t);
+
+void parser_init(struct parser* p, struct arena* mem) {
+    p->mem = mem;
+    parser_reset(p);
+}
+
+void parser_reset(struct parser* p) {
+    p->list = NULL;
+    p->tail = &p->list;
+    p->open = NULL;
+}
+
+int parser_pending(const struct parser* p) {
+    return p->open != NULL;
+}
+
+int parse_line(struct parser* p, const char* line) {
+    struct lexer lx;
+    struct token t;
+
+    lx.p = line;
+    lx.mem = p->mem;
+    if (next_token(&lx, &t) == -1)
+        goto error;
+
+    while (t.type != TOK_END) {
+        if (t.type == TOK_SEMI) {
+            if (next_token(&lx, &t) == -1)
+                goto error;
+            continue;
+        }
+
+        if (is_keyword(&t)) {
+            const int fi = strcmp(t.text, "fi") == 0;
+            if (parse_keyword(p, &t) == -1)
+                return syntax_error(p, &t);
+            if (next_token(&lx, &t) == -1)
+                goto error;
+            // a command follows if, then and else right away, fi ends one.
+            if (fi && t.type != TOK_SEMI && t.type != TOK_END)
+                return syntax_error(p, &t);
+            continue;
+        }
+
+        struct node* n = NULL;
+        if (parse_pipeline(p, &lx, &t, &n) == -1)
+            return -1;
+
+        if (t.type == TOK_AMP) {
+            n->background = 1;
+            if (next_token(&lx, &t) == -1)
+                goto error;
+            continue;
+        }
+        if (t.type != TOK_SEMI && t.type != TOK_END)
+            return syntax_error(p, &t);
+    }
+
+    return 0;
+
+error:
+    parser_reset(p);
+    return -1;
+}
+
+/*
+ * parse_pipeline parses the pipeline starting at @t, appends it and stores it
+ * to @out, @t is the token after the pipeline then.
+ */
+static int
+parse_pipeline(struct parser* p, struct lexer* lx, struct token* t, struct node** out) {
+    struct node* n = NULL;
+    struct command_node** tail = NULL;
+
+    if ((n = new_node(p, NODE_PIPELINE)) == NULL)
+        goto error;
+    tail = &n->cmds;
+
+    for (;;) {
+        struct word* words = NULL;
+        struct word** wtail = &words;
+        int argc = 0;
+
+        for (; t->type == TOK_WORD; argc++) {
+            struct word* w = arena_alloc(p->mem, sizeof(struct word));
+            if (w == NULL)
+                goto error;
+            w->text = t->text;
+            w->next = NULL;
+            *wtail = w;
+            wtail = &w->next;
+
+            if (next_token(lx, t) == -1)
+                goto error;
+        }
+
+        if (argc == 0)
+            return syntax_error(p, t);
+
+        struct command_node* c = arena_alloc(p->mem, sizeof(struct command_node));
+        char** argv = arena_alloc(p->mem, (argc + 1) * sizeof(char*));
+        if (c == NULL || argv == NULL)
+            goto error;
+
+        for (int i = 0; words != NULL; words = words->next)
+            argv[i++] = words->text;
+        argv[argc] = NULL;
+
+        c->argv = argv;
+        c->next = NULL;
+        *tail = c;
+        tail = &c->next;
+        n->ncmds++;
+
+        if (t->type != TOK_PIPE)
+            break;
+        if (next_token(lx, t) == -1)
+            goto error;
+    }
+
+    append(p, n);
+    *out = n;
+    return 0;
+
+error:
+    parser_reset(p);
+    return -1;
+}
+
+/* parse_keyword opens, switches or closes an if node. */
+static int parse_keyword(struct parser* p, const struct token* t) {
+    struct parse_frame* f = p->open;
+
+    if (strcmp(t->text, "if") == 0) {
+        struct node* n = new_node(p, NODE_IF);
+        if (n == NULL || (f = arena_alloc(p->mem, sizeof(struct parse_frame))) == NULL)
+            return -1;
+
+        append(p, n);
+        f->node = n;
+        f->tail = &n->cond;
+        f->part = PART_COND;
+        f->up = p->open;
+        p->open = f;
+        return 0;
+    }
+
+    // then, else and fi need an open if, every part has at least one command.
+    if (f == NULL)
+        return -1;
+
+    if (strcmp(t->text, "then") == 0) {
+        if (f->part != PART_COND || f->node->cond == NULL)
+            return -1;
+        f->part = PART_THEN;
+        f->tail = &f->node->then;
+    } else if (strcmp(t->text, "else") == 0) {
+        if (f->part != PART_THEN || f->node->then == NULL)
+            return -1;
+        f->part = PART_ELSE;
+        f->tail = &f->node->els;
+    } else {
+        if (f->part == PART_COND || (f->part == PART_THEN && f->node->then == NULL)
+            || (f->part == PART_ELSE && f->node->els == NULL))
+            return -1;
+        p->open = f->up;
+    }
+
+    return 0;
+}
+
+static int is_keyword(const struct token* t) {
+    return t->type == TOK_WORD && !t->quoted
+           && (strcmp(t->text, "if") == 0 || strcmp(t->text, "then") == 0
+               || strcmp(t->text, "else") == 0 || strcmp(t->text, "fi") == 0);
+}
+
+/* append adds @n to the list of the open if part or to the top level one. */
+static void append(struct parser* p, struct node* n) {
+    struct node*** tail = p->open != NULL ? &p->open->tail : &p->tail;
+    **tail = n;
+    *tail = &n->next;
+}
+
+static struct node* new_node(struct parser* p, enum node_type type) {
+    struct node* n = arena_alloc(p->mem, sizeof(struct node));
+    if (n == NULL)
+        return NULL;
+
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    return n;
+}
+
+static int syntax_error(struct parser* p, const struct token* t) {
+    const char* s = "newline";
+    if (t->type == TOK_WORD)
+        s = t->text;
+    else if (t->type == TOK_PIPE)
+        s = "|";
+    else if (t->type == TOK_SEMI)
+        s = ";";
+    else if (t->type == TOK_AMP)
+        s = "&";
+
+    fprintf(stderr, "sh: syntax error near unexpected token `%s'\n", s);
+    parser_reset(p);
+    return -1;
+}
+
+/* next_token reads the next token of @lx into @t. Returns -1 in case of the error. */
+static int next_token(struct lexer* lx, struct token* t) {
+    const char* p = lx->p;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+
+    t->text = NULL;
+    t->quoted = 0;
+
+    if (*p == '\0' || *p == '#') {
+        t->type = TOK_END;
+        lx->p = p;
+        return 0;
+    }
+
+    if (*p == '|' || *p == ';' || *p == '&') {
+        t->type = *p == '|' ? TOK_PIPE : *p == ';' ? TOK_SEMI : TOK_AMP;
+        lx->p = p + 1;
+        return 0;
+    }
+
+    const char* end = word_end(p);
+    if (end == NULL) {
+        fprintf(stderr, "sh: unexpected end of line, a quote isn't closed\n");
+        return -1;
+    }
+
+    const char* quote = strpbrk(p, "'\"\\");
+    t->type = TOK_WORD;
+    t->quoted = quote != NULL && quote < end;
+    if ((t->text = unquote(lx->mem, p, end)) == NULL)
+        return -1;
+
+    lx->p = end;
+    return 0;
+}
+
+/* word_end returns the end of the raw word at @p or NULL if a quote isn't closed. */
+static const char* word_end(const char* p) {
+    for (; *p != '\0'; p++) {
+        switch (*p) {
+        case ' ':
+        case '\t':
+        case '|':
+        case ';':
+        case '&':
+            return p;
+        case '\\':
+            if (p[1] != '\0')
+                p++;
+            break;
+        case '\'':
+            if ((p = strchr(p + 1, '\'')) == NULL)
+                return NULL;
+            break;
+        case '"':
+            for (p++; *p != '"'; p++) {
+                if (*p == '\0')
+                    return NULL;
+                if (*p == '\\' && (p[1] == '"' || p[1] == '\\'))
+                    p++;
+            }
+            break;
+        }
+    }
+
+    return p;
+}
+
+/* unquote copies the raw word [@p, @end) to @mem without the quoting. */
+static char* unquote(struct arena* mem, const char* p, const char* end) {
+    char* w = arena_alloc(mem, end - p + 1);
+    char* q = w;
+    if (w == NULL)
+        return NULL;
+
+    while (p < end) {
+        if (*p == '\\' && p + 1 < end) {
+            *q++ = p[1];
+            p += 2;
+        } else if (*p == '\'') {
+            for (p++; *p != '\''; p++)
+                *q++ = *p;
+            p++;
+        } else if (*p == '"') {
+            for (p++; *p != '"'; p++) {
+                if (*p == '\\' && (p[1] == '"' || p[1] == '\\'))
+                    p++;
+                *q++ = *p;
+            }
+            p++;
+        } else {
+            *q++ = *p++;
+        }
+    }
+
+    *q = '\0';
+    return w;
+}
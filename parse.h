@@ -0,0 +1,57 @@
+/*
+ * The sh grammar: a line is a list of pipelines separated by `;` or `&`, the
+ * latter runs the pipeline in the background. A pipeline is a list of
+ * commands separated by `|` and a command is a list of words. A word may be
+ * quoted with '' or "", a backslash escapes the next character and `#`
+ * starts a comment. if, then, else and fi at the start of a command build an
+ * if node, it may span several lines and contain other ones.
+ *
+ * The nodes are allocated from an arena, they are parsed once and can be
+ * executed any number of times. Uses arena.h.
+ */
+enum node_type { NODE_PIPELINE, NODE_IF };
+
+struct command_node {
+    char** argv;               /* NULL terminated */
+    struct command_node* next; /* the next command of the pipeline */
+};
+
+struct node {
+    enum node_type type;
+    struct node* next; /* the next node of the list */
+
+    struct command_node* cmds; /* NODE_PIPELINE */
+    int ncmds;
+    int background; /* ended with & */
+
+    struct node* cond; /* NODE_IF, the lists of its parts */
+    struct node* then;
+    struct node* els;
+};
+
+struct parse_frame;
+
+struct parser {
+    struct arena* mem;
+    struct node* list;         /* the top level nodes parsed since the reset */
+    struct node** tail;        /* where the next top level node goes */
+    struct parse_frame* open;  /* the innermost if node that isn't closed */
+};
+
+void parser_init(struct parser* p, struct arena* mem);
+
+/*
+ * parser_reset forgets the parsed nodes, their memory can be released by the
+ * caller now.
+ */
+void parser_reset(struct parser* p);
+
+/*
+ * parse_line adds the nodes of @line to @p->list. A syntax error is reported
+ * and everything parsed since the last reset is dropped. Returns -1 in case of
+ * the error.
+ */
+int parse_line(struct parser* p, const char* line);
+
+/* parser_pending tells whether an if node waits for the next lines. */
+int parser_pending(const struct parser* p);
@@ -1,158 +1,936 @@
-#include <ctype.h>
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <locale.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "macros.h"
+#include "wccache.h"
+
+struct argset;
 
 /*
- * TODO: fix deadlock
+ * chunk is a part of a file counted by one worker. Regular files larger than
+ * CHUNK_SIZE are split, every chunk is counted from the initial state and the
+ * per-chunk counts are merged in the file order when the last one is done.
  */
-
-void* cw(void* a);
+struct chunk {
+    struct argset* arg;
+    off_t off;
+    off_t len; /* -1 - read the file sequentially until EOF */
+    struct wc_counts cnt;
+};
 
 struct argset {
     char* fname;
-    int bc;  /* bytes counter */
-    int nlc; /* new lines counter */
-    int wc;  /* words counter */
+    struct wc_counts cnt;
+
+    int fd;
+    int nchunks;
+    int remaining; /* number of chunks that are not counted yet */
+    struct chunk* chunks;
+
+    int cacheable;             /* @ce has to be stored in the cache */
+    struct wc_cache_entry ce; /* the cache key and the hashes of the file */
+
+    int err;  /* the file couldn't be counted */
+    int done; /* the result was received by the main thread */
+
+    struct argset* next; /* link in the result queue */
+};
+
+enum { CHUNK_SIZE = 64 * 1024 * 1024 };
+
+/*
+ * result_queue is an intrusive multi-producer single-consumer queue
+ * (D. Vyukov's algorithm). Workers push finished files without taking any
+ * lock, the main thread pops them. The mutex and the condition variable are
+ * only used to park the consumer when the queue is empty.
+ */
+struct result_queue {
+    struct argset* head; /* producers swap themselves in here */
+    struct argset* tail; /* the consumer pops from here */
+    struct argset stub;
+
+    int waiting; /* the consumer is going to sleep */
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+/*
+ * unit is a piece of work in a worker deque: either a whole file that has to
+ * be opened (and maybe split) or one chunk of an already opened file.
+ */
+struct unit {
+    struct argset* arg;
+    struct chunk* chunk; /* NULL - open the file */
 };
 
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t flag = PTHREAD_COND_INITIALIZER;
-struct argset* mailbox;
+/*
+ * deque is a per-worker double-ended queue of units. The owner pushes and
+ * pops at the bottom, idle workers steal from the top, so a thief takes the
+ * oldest piece of work. Units are large (a file or a whole chunk), a mutex
+ * per deque is cheap enough here.
+ */
+struct deque {
+    pthread_mutex_t lock;
+    struct unit* items;
+    size_t cap;
+    size_t top;    /* index of the oldest unit */
+    size_t bottom; /* index past the newest unit */
+};
+
+/*
+ * pool is a fixed set of workers, each one with its own deque. Files are
+ * dealt to the deques in the argument order. A worker that opens a file
+ * larger than CHUNK_SIZE pushes its chunks to its own deque, so idle workers
+ * can steal them. The worker counting the last chunk of a file pushes the
+ * file to @results.
+ */
+struct pool {
+    struct argset* files;
+    int nfiles;
+
+    struct deque* deques;
+    int nworkers;
+    int pending; /* units that are queued or being counted */
+
+    // idle workers sleep on @wake until a unit is pushed or the work is over.
+    pthread_mutex_t park;
+    pthread_cond_t wake;
+    unsigned seq; /* bumped on every notify */
+    int sleepers;
+
+    struct result_queue results;
+};
+
+struct worker {
+    struct pool* pool;
+    int id; /* index of the own deque */
+};
+
+static void* worker(void* p);
+static int next_unit(struct worker* w, struct unit* u);
+static void run_unit(struct worker* w, struct unit* u);
+static void unit_done(struct pool* pool);
+static void notify(struct pool* pool);
+
+static struct chunk* split_file(struct worker* w, struct argset* arg);
+static int cw(struct chunk* c);
+static void finish_file(struct pool* pool, struct argset* arg);
+
+static void deque_init(struct deque* d);
+static void deque_push(struct deque* d, struct unit* u);
+static int deque_pop(struct deque* d, struct unit* u);
+static int deque_steal(struct deque* d, struct unit* u);
+
+static void queue_init(struct result_queue* q);
+static void queue_push(struct result_queue* q, struct argset* n);
+static struct argset* queue_pop(struct result_queue* q);
+static struct argset* queue_wait(struct result_queue* q);
+
+/*
+ * ring is a set of large buffers shared by the stdin reader and the counting
+ * workers. The part number seq of the stream goes to the slot
+ * seq % RING_SLOTS. The reader merges the counts of a slot before refilling
+ * it, so the parts are merged in the stream order.
+ */
+enum { RING_SLOTS = 16, RING_BUF_SIZE = 1024 * 1024 };
+
+enum { SLOT_FREE, SLOT_FILLED, SLOT_COUNTED };
+
+struct slot {
+    char* buf;
+    size_t len;
+    int state;
+    struct wc_counts cnt;
+};
+
+struct ring {
+    struct slot slots[RING_SLOTS];
+
+    pthread_mutex_t lock;
+    pthread_cond_t filled;  /* a slot was filled or the stream is over */
+    pthread_cond_t counted; /* a slot was counted */
+    size_t nfilled;         /* number of parts read so far */
+    size_t ncounting;       /* number of parts taken by the workers */
+    size_t nmerged;         /* number of parts merged, only the reader uses it */
+    int eof;
+};
+
+static int count_stdin(int nthr);
+static void* ring_worker(void* p);
+static void ring_merge(struct ring* r, struct wc_counts* total);
+
+static int count_serial(int fd, const char* name, struct wc_counts* c);
+static void print_counts(struct wc_counts* c, const char* name);
+static int workers_num(char* val);
+
+/* metrics to count and print, a set of WC_* flags */
+static unsigned what = 0;
+
+/* counts of the files from the previous runs, see -C */
+static struct wc_cache cache;
+static const char* cache_path = NULL;
 
 int main(int ac, char* av[]) {
-    char** fnames = av + 1;
-    mailbox = NULL;
+    char* nthrval = NULL;
+
+    // -L takes the character widths from the locale.
+    setlocale(LC_CTYPE, "");
+
+    int opt = 0;
+    while ((opt = getopt(ac, av, "lwcmLj:C:")) != -1) {
+        switch (opt) {
+        case 'l':
+            what |= WC_LINES;
+            break;
+        case 'w':
+            what |= WC_WORDS;
+            break;
+        case 'c':
+            what |= WC_BYTES;
+            break;
+        case 'm':
+            what |= WC_CHARS;
+            break;
+        case 'L':
+            what |= WC_MAXLEN;
+            break;
+        case 'j':
+            nthrval = optarg;
+            break;
+        case 'C':
+            cache_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-lwcmL] [-j threads] [-C cache] [file ...]\n",
+                    av[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (what == 0)
+        what = WC_LINES | WC_WORDS | WC_BYTES;
+    wc_select(what);
+
+    struct pool pool;
+    pool.nfiles = ac - optind;
+    pool.pending = pool.nfiles;
+    pool.seq = 0;
+    pool.sleepers = 0;
+    queue_init(&pool.results);
 
     int ret = 0;
-    ret = pthread_mutex_lock(&lock);
-    if (ret != 0)
-        handle_error_en(ret, "pthread_mutex_lock");
+    if ((ret = pthread_mutex_init(&pool.park, NULL)) != 0)
+        handle_error_en(ret, "pthread_mutex_init");
+    if ((ret = pthread_cond_init(&pool.wake, NULL)) != 0)
+        handle_error_en(ret, "pthread_cond_init");
 
-    pthread_t thrds[ac - 1];
-    struct argset args[ac - 1];
+    const int nthr = workers_num(nthrval);
+    if (nthr == -1)
+        exit(EXIT_FAILURE);
+
+    if (pool.nfiles == 0) {
+        if (count_stdin(nthr) == -1)
+            exit(EXIT_FAILURE);
+        exit(EXIT_SUCCESS);
+    }
 
-    for (int i = 0; i < ac - 1; i++) {
-        args[i].fname = fnames[i];
-        args[i].bc = 0;
-        args[i].nlc = 0;
-        args[i].wc = 0;
+    if (cache_path != NULL && wc_cache_load(&cache, cache_path) == -1)
+        exit(EXIT_FAILURE);
 
-        ret = pthread_create(&thrds[i], NULL, cw, (void*)&args[i]);
+    pool.nworkers = nthr;
+    pool.files = calloc(pool.nfiles, sizeof(struct argset));
+    pool.deques = calloc(nthr, sizeof(struct deque));
+    pthread_t* thrds = calloc(nthr, sizeof(pthread_t));
+    struct worker* workers = calloc(nthr, sizeof(struct worker));
+    if (pool.files == NULL || pool.deques == NULL || thrds == NULL || workers == NULL) {
+        fprintf(stderr, "calloc, no memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < nthr; i++)
+        deque_init(&pool.deques[i]);
+
+    // the owner pops from the bottom, deal the files backwards to get the
+    // earlier files counted first.
+    for (int i = pool.nfiles - 1; i >= 0; i--) {
+        pool.files[i].fname = av[optind + i];
+        pool.files[i].fd = -1;
+
+        struct unit u = { &pool.files[i], NULL };
+        deque_push(&pool.deques[i % nthr], &u);
+    }
+
+    for (int i = 0; i < nthr; i++) {
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        ret = pthread_create(&thrds[i], NULL, worker, (void*)&workers[i]);
         if (ret != 0)
             handle_error_en(ret, "pthread_create");
     }
 
-    int msg_num = 0;
-    while (msg_num < (ac - 1)) {
-        ret = pthread_cond_wait(&flag, &lock);
+    // Results come in the completion order, the reorder buffer (the `done`
+    // flags) lets to print them in the argument order.
+    int status = EXIT_SUCCESS;
+    int printed = 0;
+    for (int received = 0; received < pool.nfiles; received++) {
+        struct argset* arg = queue_wait(&pool.results);
+        arg->done = 1;
+
+        while (printed < pool.nfiles && pool.files[printed].done) {
+            struct argset* a = &pool.files[printed++];
+            if (a->err) {
+                status = EXIT_FAILURE;
+                continue;
+            }
+            print_counts(&a->cnt, a->fname);
+        }
+    }
+
+    for (int i = 0; i < nthr; i++) {
+        ret = pthread_join(thrds[i], NULL);
         if (ret != 0)
-            handle_error_en(ret, "pthread_cond_wait");
+            handle_error_en(ret, "pthread_join");
+    }
 
-        printf("%d %d %d %s\n", mailbox->nlc, mailbox->wc, mailbox->bc, mailbox->fname);
+    // the workers are gone, the cache can be updated without locking.
+    if (cache_path != NULL) {
+        for (int i = 0; i < pool.nfiles; i++) {
+            struct argset* a = &pool.files[i];
+            if (!a->err && a->cacheable && wc_cache_put(&cache, &a->ce) == -1)
+                status = EXIT_FAILURE;
+        }
+        if (wc_cache_save(&cache, cache_path) == -1)
+            status = EXIT_FAILURE;
+        wc_cache_free(&cache);
+    }
 
-        mailbox = NULL;
-        msg_num++;
+    for (int i = 0; i < nthr; i++)
+        free(pool.deques[i].items);
 
-        ret = pthread_cond_signal(&flag);
-        if (ret != 0)
-            handle_error_en(ret, "pthread_cond_signal");
+    free(workers);
+    free(thrds);
+    free(pool.deques);
+    free(pool.files);
+    exit(status);
+}
 
-        ret = pthread_mutex_unlock(&lock);
-        if (ret != 0)
+/*
+ * count_stdin counts the standard input: the calling thread reads it into the
+ * ring, @nthr workers count the filled slots in parallel.
+ */
+static int count_stdin(int nthr) {
+    struct ring r;
+    struct wc_counts total;
+    struct stat sb;
+    int ret = 0;
+    int status = 0;
+
+    memset(&r, 0, sizeof(r));
+    wc_init(&total);
+
+    // the bytes of a regular file are known without reading it.
+    if (what == WC_BYTES && fstat(STDIN_FILENO, &sb) == 0 && S_ISREG(sb.st_mode)) {
+        off_t off = lseek(STDIN_FILENO, 0, SEEK_CUR);
+        if (off != -1 && off <= sb.st_size) {
+            total.bytes = sb.st_size - off;
+            print_counts(&total, NULL);
+            return 0;
+        }
+    }
+
+    // the longest line can't be merged from parts, count sequentially.
+    if (what & WC_MAXLEN) {
+        if (count_serial(STDIN_FILENO, "stdin", &total) == -1)
+            return -1;
+        print_counts(&total, NULL);
+        return 0;
+    }
+
+    if ((ret = pthread_mutex_init(&r.lock, NULL)) != 0)
+        handle_error_en(ret, "pthread_mutex_init");
+    if ((ret = pthread_cond_init(&r.filled, NULL)) != 0)
+        handle_error_en(ret, "pthread_cond_init");
+    if ((ret = pthread_cond_init(&r.counted, NULL)) != 0)
+        handle_error_en(ret, "pthread_cond_init");
+
+    for (int i = 0; i < RING_SLOTS; i++) {
+        if ((r.slots[i].buf = malloc(RING_BUF_SIZE)) == NULL)
+            handle_error("malloc");
+    }
+
+    pthread_t* thrds = calloc(nthr, sizeof(pthread_t));
+    if (thrds == NULL)
+        handle_error("calloc");
+
+    for (int i = 0; i < nthr; i++) {
+        if ((ret = pthread_create(&thrds[i], NULL, ring_worker, (void*)&r)) != 0)
+            handle_error_en(ret, "pthread_create");
+    }
+
+    size_t seq = 0;
+    for (;; seq++) {
+        struct slot* s = &r.slots[seq % RING_SLOTS];
+
+        // the slot still holds the part seq - RING_SLOTS.
+        if (seq >= RING_SLOTS)
+            ring_merge(&r, &total);
+
+        ssize_t n = 0;
+        s->len = 0;
+        while (s->len < RING_BUF_SIZE) {
+            if ((n = read(STDIN_FILENO, s->buf + s->len, RING_BUF_SIZE - s->len)) <= 0)
+                break;
+            s->len += n;
+        }
+
+        if (n == -1) {
+            perror("read");
+            status = -1;
+        }
+        if (s->len == 0)
+            break;
+
+        if ((ret = pthread_mutex_lock(&r.lock)) != 0)
+            handle_error_en(ret, "pthread_mutex_lock");
+        s->state = SLOT_FILLED;
+        r.nfilled = seq + 1;
+        if ((ret = pthread_cond_signal(&r.filled)) != 0)
+            handle_error_en(ret, "pthread_cond_signal");
+        if ((ret = pthread_mutex_unlock(&r.lock)) != 0)
             handle_error_en(ret, "pthread_mutex_unlock");
+
+        if (n <= 0)
+            break;
     }
 
-    for (int i = 0; i < ac - 1; i++) {
-        ret = pthread_join(thrds[i], NULL);
-        if (ret != 0)
+    if ((ret = pthread_mutex_lock(&r.lock)) != 0)
+        handle_error_en(ret, "pthread_mutex_lock");
+    r.eof = 1;
+    if ((ret = pthread_cond_broadcast(&r.filled)) != 0)
+        handle_error_en(ret, "pthread_cond_broadcast");
+    if ((ret = pthread_mutex_unlock(&r.lock)) != 0)
+        handle_error_en(ret, "pthread_mutex_unlock");
+
+    // the last read might have found nothing after its slot was merged.
+    while (r.nmerged < r.nfilled)
+        ring_merge(&r, &total);
+
+    for (int i = 0; i < nthr; i++) {
+        if ((ret = pthread_join(thrds[i], NULL)) != 0)
             handle_error_en(ret, "pthread_join");
     }
 
-    exit(EXIT_SUCCESS);
+    for (int i = 0; i < RING_SLOTS; i++)
+        free(r.slots[i].buf);
+    free(thrds);
+
+    if (status == 0)
+        print_counts(&total, NULL);
+    return status;
 }
 
-void* cw(void* a) {
-    struct argset* arg = (struct argset*)a;
+static int count_serial(int fd, const char* name, struct wc_counts* c) {
+    char buf[BUFSIZ * 16];
+    ssize_t n = 0;
 
-    FILE* f = fopen(arg->fname, "r");
-    if (f == NULL) {
-        fprintf(stderr, "fopen(%s): %s\n", arg->fname, strerror(errno));
-        return NULL;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        wc_count(c, buf, n);
+
+    if (n == -1) {
+        fprintf(stderr, "read(%s): %s\n", name, strerror(errno));
+        return -1;
     }
 
-    static const int in_word_state = 0;
-    static const int out_word_state = 1;
+    return 0;
+}
+
+static void print_counts(struct wc_counts* c, const char* name) {
+    wc_print(stdout, what, c, name);
+}
+
+static void* ring_worker(void* p) {
+    struct ring* r = (struct ring*)p;
+    int ret = 0;
+
+    if ((ret = pthread_mutex_lock(&r->lock)) != 0)
+        handle_error_en(ret, "pthread_mutex_lock");
 
-    int state = out_word_state;
-    int c = 0;
     for (;;) {
-        c = fgetc(f);
+        if (r->ncounting < r->nfilled) {
+            struct slot* s = &r->slots[r->ncounting++ % RING_SLOTS];
 
-        if (ferror(f) != 0) {
-            perror("fgetc");
-            goto error;
+            if ((ret = pthread_mutex_unlock(&r->lock)) != 0)
+                handle_error_en(ret, "pthread_mutex_unlock");
+
+            wc_init(&s->cnt);
+            wc_count(&s->cnt, s->buf, s->len);
+
+            if ((ret = pthread_mutex_lock(&r->lock)) != 0)
+                handle_error_en(ret, "pthread_mutex_lock");
+            s->state = SLOT_COUNTED;
+            if ((ret = pthread_cond_signal(&r->counted)) != 0)
+                handle_error_en(ret, "pthread_cond_signal");
+            continue;
         }
-        if (feof(f)) {
+
+        if (r->eof)
             break;
+
+        if ((ret = pthread_cond_wait(&r->filled, &r->lock)) != 0)
+            handle_error_en(ret, "pthread_cond_wait");
+    }
+
+    if ((ret = pthread_mutex_unlock(&r->lock)) != 0)
+        handle_error_en(ret, "pthread_mutex_unlock");
+
+    return NULL;
+}
+
+/*
+ * ring_merge waits until the next part to merge is counted, merges it into
+ * @total and frees its slot.
+ */
+static void ring_merge(struct ring* r, struct wc_counts* total) {
+    struct slot* s = &r->slots[r->nmerged++ % RING_SLOTS];
+    int ret = 0;
+
+    if ((ret = pthread_mutex_lock(&r->lock)) != 0)
+        handle_error_en(ret, "pthread_mutex_lock");
+    while (s->state != SLOT_COUNTED) {
+        if ((ret = pthread_cond_wait(&r->counted, &r->lock)) != 0)
+            handle_error_en(ret, "pthread_cond_wait");
+    }
+    s->state = SLOT_FREE;
+    if ((ret = pthread_mutex_unlock(&r->lock)) != 0)
+        handle_error_en(ret, "pthread_mutex_unlock");
+
+    wc_merge(total, &s->cnt);
+}
+
+static int workers_num(char* val) {
+    long n = 0;
+
+    if (val != NULL) {
+        errno = 0;
+        n = strtol(val, NULL, 10);
+        if (errno != 0 || n <= 0) {
+            fprintf(stderr, "pwc: invalid number of threads %s\n", val);
+            return -1;
+        }
+    } else if ((n = sysconf(_SC_NPROCESSORS_ONLN)) == -1) {
+        n = 1;
+    }
+
+    return (int)n;
+}
+
+static void* worker(void* p) {
+    struct worker* w = (struct worker*)p;
+    struct unit u;
+
+    while (next_unit(w, &u))
+        run_unit(w, &u);
+
+    return NULL;
+}
+
+/*
+ * next_unit takes a unit from the own deque or steals one from the others.
+ * Returns 0 when all the work is done.
+ */
+static int next_unit(struct worker* w, struct unit* u) {
+    struct pool* pool = w->pool;
+    int ret = 0;
+
+    for (;;) {
+        if (deque_pop(&pool->deques[w->id], u))
+            return 1;
+
+        const unsigned seq = __atomic_load_n(&pool->seq, __ATOMIC_SEQ_CST);
+
+        for (int i = 1; i < pool->nworkers; i++) {
+            if (deque_steal(&pool->deques[(w->id + i) % pool->nworkers], u))
+                return 1;
         }
 
-        if (c == '\n')
-            arg->nlc++;
-        if (c == ' ' || c == '\t' || c == '\n')
-            state = out_word_state;
-        if (state == out_word_state) {
-            state = in_word_state;
-            arg->wc++;
+        if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0)
+            return 0;
+
+        // nothing to steal, but the units being counted may bring more.
+        if ((ret = pthread_mutex_lock(&pool->park)) != 0)
+            handle_error_en(ret, "pthread_mutex_lock");
+
+        __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&pool->seq, __ATOMIC_SEQ_CST) == seq
+            && __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) != 0) {
+            if ((ret = pthread_cond_wait(&pool->wake, &pool->park)) != 0)
+                handle_error_en(ret, "pthread_cond_wait");
         }
-        arg->bc++;
+        __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+
+        if ((ret = pthread_mutex_unlock(&pool->park)) != 0)
+            handle_error_en(ret, "pthread_mutex_unlock");
     }
+}
 
-    if (fclose(f) == EOF) {
-        perror("fclose");
-        return NULL;
+static void run_unit(struct worker* w, struct unit* u) {
+    struct argset* arg = u->arg;
+    struct chunk* c = u->chunk;
+
+    if (c == NULL && (c = split_file(w, arg)) == NULL) {
+        arg->err = 1;
+        queue_push(&w->pool->results, arg);
+        unit_done(w->pool);
+        return;
     }
 
+    if (cw(c) == -1)
+        __atomic_store_n(&arg->err, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_sub_fetch(&arg->remaining, 1, __ATOMIC_ACQ_REL) == 0)
+        finish_file(w->pool, arg);
+
+    unit_done(w->pool);
+}
+
+static void unit_done(struct pool* pool) {
+    if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0)
+        notify(pool);
+}
+
+static void notify(struct pool* pool) {
     int ret = 0;
-    ret = pthread_mutex_lock(&lock);
-    if (ret != 0) {
+
+    __atomic_add_fetch(&pool->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) == 0)
+        return;
+
+    if ((ret = pthread_mutex_lock(&pool->park)) != 0)
+        handle_error_en(ret, "pthread_mutex_lock");
+    if ((ret = pthread_cond_broadcast(&pool->wake)) != 0)
+        handle_error_en(ret, "pthread_cond_broadcast");
+    if ((ret = pthread_mutex_unlock(&pool->park)) != 0)
+        handle_error_en(ret, "pthread_mutex_unlock");
+}
+
+/*
+ * split_file opens the file, pushes all its chunks but the first one to the
+ * worker deque and returns the first one. Returns NULL in case of the error.
+ * A file that only grew since it was cached is split from the cached size on,
+ * the first chunk continues from the cached counts.
+ */
+static struct chunk* split_file(struct worker* w, struct argset* arg) {
+    struct stat sb;
+
+    if ((arg->fd = open(arg->fname, O_RDONLY)) == -1) {
+        fprintf(stderr, "open(%s): %s\n", arg->fname, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(arg->fd, &sb) == -1) {
+        fprintf(stderr, "fstat(%s): %s\n", arg->fname, strerror(errno));
         goto error;
     }
 
-    // It's possible that a thread takes a lock too fast and a main thread does
-    // not handle value in mailbox that was left by last thread, need to wait
-    // until main thread handles this value.
-    if (mailbox != NULL) {
-        pthread_cond_wait(&flag, &lock);
+    // -c alone is answered by fstat, -L has to be counted sequentially.
+    const int is_sized = what == WC_BYTES && S_ISREG(sb.st_mode);
+
+    const struct wc_cache_entry* cached = NULL;
+    off_t start = 0;
+    if (cache_path != NULL && S_ISREG(sb.st_mode) && !is_sized) {
+        arg->cacheable = 1;
+        arg->ce.dev = sb.st_dev;
+        arg->ce.ino = sb.st_ino;
+        arg->ce.what = what;
+        wc_cache_times(&sb, &arg->ce);
+
+        cached = wc_cache_find(&cache, sb.st_dev, sb.st_ino);
+        if (cached != NULL
+            && (cached->what != what || !wc_cache_valid(arg->fd, &sb, cached)))
+            cached = NULL;
+        if (cached != NULL)
+            start = cached->cnt.bytes;
     }
 
-    mailbox = arg;
+    arg->nchunks = 1;
+    if (S_ISREG(sb.st_mode) && sb.st_size - start > CHUNK_SIZE && !is_sized
+        && !(what & WC_MAXLEN))
+        arg->nchunks = (sb.st_size - start + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    arg->remaining = arg->nchunks;
 
-    ret = pthread_cond_signal(&flag);
-    if (ret != 0) {
+    if ((arg->chunks = calloc(arg->nchunks, sizeof(struct chunk))) == NULL) {
+        fprintf(stderr, "calloc, no memory\n");
         goto error;
     }
 
-    ret = pthread_mutex_unlock(&lock);
-    if (ret != 0) {
-        goto error;
+    for (int i = 0; i < arg->nchunks; i++) {
+        struct chunk* c = &arg->chunks[i];
+        c->arg = arg;
+        c->off = start + (off_t)i * CHUNK_SIZE;
+        c->len = CHUNK_SIZE;
+        if (i == arg->nchunks - 1)
+            c->len = sb.st_size - c->off;
+        wc_init(&c->cnt);
+    }
+    if (cached != NULL)
+        arg->chunks[0].cnt = cached->cnt;
+    if (is_sized) {
+        arg->chunks[0].len = 0;
+        arg->chunks[0].cnt.bytes = sb.st_size;
+        return &arg->chunks[0];
+    }
+    if (arg->nchunks == 1) {
+        if (start > 0 && lseek(arg->fd, start, SEEK_SET) == -1) {
+            fprintf(stderr, "lseek(%s): %s\n", arg->fname, strerror(errno));
+            goto error;
+        }
+        arg->chunks[0].len = -1;
+        return &arg->chunks[0];
     }
 
-    return NULL;
+    __atomic_add_fetch(&w->pool->pending, arg->nchunks - 1, __ATOMIC_SEQ_CST);
+    for (int i = arg->nchunks - 1; i > 0; i--) {
+        struct unit u = { arg, &arg->chunks[i] };
+        deque_push(&w->pool->deques[w->id], &u);
+    }
+    notify(w->pool);
+
+    return &arg->chunks[0];
 
 error:
-    if (f != NULL) {
-        if (fclose(f) == EOF) {
-            perror("fclose");
+    if (close(arg->fd) == -1)
+        fprintf(stderr, "close(%s): %s\n", arg->fname, strerror(errno));
+    arg->fd = -1;
+    free(arg->chunks);
+    arg->chunks = NULL;
+    return NULL;
+}
+
+static int cw(struct chunk* c) {
+    char buf[BUFSIZ * 16];
+    const int fd = c->arg->fd;
+    ssize_t n = 0;
+
+    if (c->len == -1)
+        return count_serial(fd, c->arg->fname, &c->cnt);
+
+    off_t off = c->off;
+    off_t end = c->off + c->len;
+    while (off < end) {
+        size_t want = end - off < (off_t)sizeof(buf) ? (size_t)(end - off) : sizeof(buf);
+        if ((n = pread(fd, buf, want, off)) <= 0)
+            break;
+        wc_count(&c->cnt, buf, n);
+        off += n;
+    }
+
+    if (n == -1) {
+        fprintf(stderr, "pread(%s): %s\n", c->arg->fname, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * finish_file merges the chunks of @arg in the file order and hands the file
+ * over to the main thread.
+ */
+static void finish_file(struct pool* pool, struct argset* arg) {
+    wc_init(&arg->cnt);
+    for (int i = 0; i < arg->nchunks; i++)
+        wc_merge(&arg->cnt, &arg->chunks[i].cnt);
+
+    if (arg->cacheable) {
+        arg->ce.cnt = arg->cnt;
+        if (wc_cache_sample(arg->fd, &arg->ce) == -1)
+            arg->cacheable = 0;
+    }
+
+    if (close(arg->fd) == -1) {
+        fprintf(stderr, "close(%s): %s\n", arg->fname, strerror(errno));
+        arg->err = 1;
+    }
+    arg->fd = -1;
+
+    free(arg->chunks);
+    arg->chunks = NULL;
+
+    queue_push(&pool->results, arg);
+}
+
+static void deque_init(struct deque* d) {
+    int ret = 0;
+    if ((ret = pthread_mutex_init(&d->lock, NULL)) != 0)
+        handle_error_en(ret, "pthread_mutex_init");
+
+    d->items = NULL;
+    d->cap = 0;
+    d->top = 0;
+    d->bottom = 0;
+}
+
+static void deque_push(struct deque* d, struct unit* u) {
+    int ret = 0;
+    if ((ret = pthread_mutex_lock(&d->lock)) != 0)
+        handle_error_en(ret, "pthread_mutex_lock");
+
+    if (d->bottom == d->cap) {
+        const size_t len = d->bottom - d->top;
+        if (d->top > 0) {
+            memmove(d->items, d->items + d->top, len * sizeof(struct unit));
+        }
+
+        if (len == d->cap) {
+            const size_t cap = d->cap == 0 ? 64 : d->cap * 2;
+            struct unit* items = realloc(d->items, cap * sizeof(struct unit));
+            if (items == NULL)
+                handle_error("realloc");
+            d->items = items;
+            d->cap = cap;
         }
+
+        d->top = 0;
+        d->bottom = len;
+    }
+    d->items[d->bottom++] = *u;
+
+    if ((ret = pthread_mutex_unlock(&d->lock)) != 0)
+        handle_error_en(ret, "pthread_mutex_unlock");
+}
+
+static int deque_pop(struct deque* d, struct unit* u) {
+    int ret = 0;
+    int found = 0;
+    if ((ret = pthread_mutex_lock(&d->lock)) != 0)
+        handle_error_en(ret, "pthread_mutex_lock");
+
+    if (d->top < d->bottom) {
+        *u = d->items[--d->bottom];
+        found = 1;
+    }
+
+    if ((ret = pthread_mutex_unlock(&d->lock)) != 0)
+        handle_error_en(ret, "pthread_mutex_unlock");
+    return found;
+}
+
+static int deque_steal(struct deque* d, struct unit* u) {
+    int ret = 0;
+    int found = 0;
+    if ((ret = pthread_mutex_lock(&d->lock)) != 0)
+        handle_error_en(ret, "pthread_mutex_lock");
+
+    if (d->top < d->bottom) {
+        *u = d->items[d->top++];
+        found = 1;
+    }
+
+    if ((ret = pthread_mutex_unlock(&d->lock)) != 0)
+        handle_error_en(ret, "pthread_mutex_unlock");
+    return found;
+}
+
+static void queue_init(struct result_queue* q) {
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+    q->waiting = 0;
+
+    int ret = 0;
+    if ((ret = pthread_mutex_init(&q->lock, NULL)) != 0)
+        handle_error_en(ret, "pthread_mutex_init");
+    if ((ret = pthread_cond_init(&q->ready, NULL)) != 0)
+        handle_error_en(ret, "pthread_cond_init");
+}
+
+static void queue_push(struct result_queue* q, struct argset* n) {
+    __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+    struct argset* prev = __atomic_exchange_n(&q->head, n, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->next, n, __ATOMIC_SEQ_CST);
+
+    if (n == &q->stub)
+        return;
+
+    // wake the consumer up only if it's (going to be) sleeping.
+    if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST)) {
+        int ret = 0;
+        if ((ret = pthread_mutex_lock(&q->lock)) != 0)
+            handle_error_en(ret, "pthread_mutex_lock");
+        if ((ret = pthread_cond_signal(&q->ready)) != 0)
+            handle_error_en(ret, "pthread_cond_signal");
+        if ((ret = pthread_mutex_unlock(&q->lock)) != 0)
+            handle_error_en(ret, "pthread_mutex_unlock");
     }
-    if (ret != 0) {
-        fprintf(stderr, "thread failed(%s): %s\n", arg->fname, strerror(ret));
+}
+
+/*
+ * queue_pop returns NULL if the queue is empty or a producer is in the
+ * middle of a push, only the consumer can call it.
+ */
+static struct argset* queue_pop(struct result_queue* q) {
+    struct argset* tail = q->tail;
+    struct argset* next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+
+    if (tail == &q->stub) {
+        if (next == NULL)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+    }
+
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
     }
+
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_SEQ_CST))
+        return NULL;
+
+    queue_push(q, &q->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+
     return NULL;
 }
+
+static struct argset* queue_wait(struct result_queue* q) {
+    struct argset* n = NULL;
+    int ret = 0;
+
+    for (;;) {
+        if ((n = queue_pop(q)) != NULL)
+            return n;
+
+        if ((ret = pthread_mutex_lock(&q->lock)) != 0)
+            handle_error_en(ret, "pthread_mutex_lock");
+
+        __atomic_store_n(&q->waiting, 1, __ATOMIC_SEQ_CST);
+        if ((n = queue_pop(q)) == NULL) {
+            if ((ret = pthread_cond_wait(&q->ready, &q->lock)) != 0)
+                handle_error_en(ret, "pthread_cond_wait");
+        }
+        __atomic_store_n(&q->waiting, 0, __ATOMIC_SEQ_CST);
+
+        if ((ret = pthread_mutex_unlock(&q->lock)) != 0)
+            handle_error_en(ret, "pthread_mutex_unlock");
+
+        if (n != NULL)
+            return n;
+    }
+}
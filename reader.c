@@ -7,6 +7,11 @@
 
 #include "reader.h"
 
+static int read_error(const char* op);
+static int write_error(const char* op);
+
+__thread volatile sig_atomic_t reader_cancel = 0;
+
 int read_files(struct read_config* conf) {
     int i = 0;
     FILE* f = NULL;
@@ -65,22 +70,7 @@ int parse_num(char* val, int* num) {
 }
 
 int read_and_print_bytes(FILE* f, size_t nmemb) {
-    char buf[nmemb];
-    ssize_t n = 0;
-    const int len = sizeof(buf) / sizeof(buf[0]);
-
-    n = fread(buf, 1, len, f);
-    if (ferror(f) != 0) {
-        perror("fread");
-        return -1;
-    }
-
-    if (fwrite(buf, 1, n, stdout) != n) {
-        perror("fwrite");
-        return -1;
-    }
-
-    return 0;
+    return copy_bytes(f, stdout, nmemb);
 }
 
 int file_len(FILE* f) {
@@ -109,12 +99,7 @@ ssize_t write_from_to(FILE* src, FILE* dst) {
     ssize_t n = 0;
     ssize_t w_len = 0;
 
-    while ((n = fread(buf, 1, buf_len, src)) > 0) {
-        if (ferror(src) != 0) {
-            perror("fread");
-            return -1;
-        }
-
+    while (!reader_cancel && (n = fread(buf, 1, buf_len, src)) > 0) {
         if (fwrite(buf, 1, n, dst) != n) {
             perror("fwrite");
             return -1;
@@ -122,5 +107,166 @@ ssize_t write_from_to(FILE* src, FILE* dst) {
         w_len += n;
     }
 
+    if (ferror(src) != 0)
+        return read_error("fread");
+    if (reader_cancel)
+        return -1;
+
     return w_len;
 }
+
+int cat_lines(FILE* in, FILE* out, int number) {
+    int ln = 1;
+    int is_new_line = 1;
+
+    int c = 0;
+    for (;;) {
+        if (reader_cancel)
+            return -1;
+
+        c = getc(in);
+        if (ferror(in) != 0)
+            return read_error("getc");
+
+        if (feof(in))
+            break;
+
+        if (is_new_line) {
+            if (number) {
+                if (fprintf(out, "  %d  ", ln) < 0)
+                    return write_error("fprintf");
+                ln++;
+                is_new_line = 0;
+            }
+        }
+
+        if (putc(c, out) == EOF)
+            return write_error("putc");
+
+        if (c == '\n')
+            is_new_line = 1;
+    }
+
+    return 0;
+}
+
+int head_lines(FILE* in, FILE* out, int nlines) {
+    int c = 0;
+    int n = 0; // number of lines that were already read
+
+    while (!reader_cancel && (c = getc(in)) != EOF) {
+        if (c == '\n') {
+            if (++n == nlines) {
+                if (putc(c, out) == EOF)
+                    return write_error("putc");
+
+                break;
+            }
+        }
+
+        if (putc(c, out) == EOF)
+            return write_error("putc");
+    }
+
+    if (ferror(in) != 0)
+        return read_error("getc");
+    if (reader_cancel)
+        return -1;
+
+    return 0;
+}
+
+int tail_lines(FILE* in, FILE* out, int nlines) {
+    int c = 0;
+    int n = 0;
+    int nc = 0; /* number of characters to print */
+
+    if (fseek(in, 0, SEEK_END) == -1) {
+        perror("fseek");
+        return -1;
+    }
+
+    do {
+        if (fseek(in, -1, SEEK_CUR) == -1) {
+            // the beginning of the file was reached, it's time to break
+            break;
+        }
+
+        c = getc(in);
+        if (ferror(in) != 0) {
+            perror("getc");
+            return -1;
+        }
+
+        if (c == '\n' && (++n == (nlines + 1)))
+            continue;
+
+        nc++;
+        if (ungetc(c, in) == EOF) {
+            perror("ungetc");
+            return -1;
+        }
+
+    } while (n != (nlines + 1));
+
+    return copy_bytes(in, out, nc);
+}
+
+int copy_bytes(FILE* in, FILE* out, size_t nmemb) {
+    char buf[BUFSIZ * 4];
+
+    while (nmemb > 0) {
+        if (reader_cancel)
+            return -1;
+
+        size_t want = nmemb < sizeof(buf) ? nmemb : sizeof(buf);
+        size_t n = fread(buf, 1, want, in);
+        if (ferror(in) != 0)
+            return read_error("fread");
+
+        if (fwrite(buf, 1, n, out) != n)
+            return write_error("fwrite");
+
+        if (n < want)
+            break;
+        nmemb -= n;
+    }
+
+    return 0;
+}
+
+FILE* spool(FILE* in) {
+    FILE* tmp = tmpfile();
+    if (tmp == NULL) {
+        perror("tmpfile");
+        return NULL;
+    }
+
+    if (write_from_to(in, tmp) == -1)
+        goto error;
+
+    if (fseek(tmp, 0, SEEK_SET) == -1) {
+        perror("fseek");
+        goto error;
+    }
+
+    return tmp;
+
+error:
+    if (fclose(tmp) == -1)
+        perror("fclose");
+    return NULL;
+}
+
+/* read_error reports the failed read, an interrupted one was cancelled. */
+static int read_error(const char* op) {
+    if (errno != EINTR)
+        perror(op);
+    return -1;
+}
+
+static int write_error(const char* op) {
+    if (errno != EPIPE && errno != EINTR)
+        perror(op);
+    return -1;
+}
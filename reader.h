@@ -1,3 +1,5 @@
+#include <signal.h>
+
 struct read_config {
     char** argv;
     int ac;       /* number of a command line arguments */
@@ -11,3 +13,23 @@ int read_files(struct read_config* config);
 int read_and_print_bytes(FILE* f, size_t nmemb);
 int file_len(FILE* f);
 ssize_t write_from_to(FILE* src, FILE* dst);
+
+/*
+ * The cores of cat, head and tail. They read @in and write to @out, so they
+ * can run in another program as well, e.g. as the builtins of sh. A write to
+ * a closed pipe isn't reported, the reader has just gone away. Return -1 in
+ * case of the error.
+ *
+ * A core stops quietly once reader_cancel of its thread is set, e.g. by a
+ * SIGINT handler installed without SA_RESTART: a blocked read fails with
+ * EINTR then.
+ */
+extern __thread volatile sig_atomic_t reader_cancel;
+
+int cat_lines(FILE* in, FILE* out, int number);
+int head_lines(FILE* in, FILE* out, int nlines);
+int tail_lines(FILE* in, FILE* out, int nlines); /* @in has to be seekable */
+int copy_bytes(FILE* in, FILE* out, size_t nmemb);
+
+/* spool copies @in to a temporary file, it's returned rewound. */
+FILE* spool(FILE* in);
@@ -1,5 +1,12 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,78 +16,142 @@
 #include <unistd.h>
 #include <utmpx.h>
 
+#include "arena.h"
+#include "builtin.h"
+#include "cmdhash.h"
+#include "parse.h"
+#include "reader.h"
+
 /* It's a basic and naive implementation of the UNIX bash.
  * It supports the following:
  *  - Run processes
- *  - If/Then/Else blocks
+ *  - If/Then/Else blocks, nested ones too
  *  - Pipes
+ *  - Background jobs and wait
+ *  - Quotes and comments
+ *  - cat, head, tail and pwc builtins
  *  - Handle Ctrl-C
  */
 
-static int execute(char** av, int* status);
-static char** init_list(int sz);
-static char** list_from_line(char* line, const char* delim, int* len);
+static int exec_list(struct node* n, int* status);
+static int exec_if(struct node* n, int* status);
+static int exec_pipeline(struct node* n, int* status);
+static int spawn(char** av, int fd_in, int fd_out, pid_t pgid, pid_t* pid, int* status);
+static int spawn_script(pid_t* pid,
+                        const char* path,
+                        const posix_spawn_file_actions_t* fa,
+                        const posix_spawnattr_t* attr,
+                        char** av);
+static int builtin_hash(char** av, int* status);
+static int builtin_exit(char** av, int* status);
+static int builtin_wait(char** av, int* status);
+static const char* shell_builtin(struct node* n);
 
 static void sig_handler(int signum);
+static void int_handler(int signum);
+static void cancel_handler(int signum);
+static void chld_handler(int signum);
 static void set_signals(void);
+static void wake(void);
 
 static char* get_host(void);
 static char* get_curr_dir(void);
 static void prompt(void);
-static void trim_suffix(char* s);
 
 static char* tty_name = NULL;
 static char* cur_dir = NULL;
 static char* host = NULL;
+static struct cmd_hash cmds_hash;
 
-struct context {
-    char** if_block;
-    char** then_block;
-    char** else_block;
-    int state;
-};
-
-static int def_state = 0;
-static int if_state = 1;
-static int then_state = 2;
-static int else_state = 3;
-static int fi_state = 4;
-
-static int add_cmd(struct context* ctx, char* cmd, int* sz, int* idx);
+static int exiting = 0; /* the exit builtin was run */
+static int exit_code = EXIT_SUCCESS;
 
-static void empty_context(struct context* ctx);
-static void set_context_state(const char* cmd, struct context* ctx);
-static int exec_context(struct context* ctx);
-static void free_context(struct context* ctx);
-
-static void free_block(char** blk);
-static int exec_block(char** blk, int* status);
-static char** block_by_state(struct context* ctx);
-static void set_block_by_state(struct context* ctx, char** blk);
-static int is_eob(int idx, int sz); // check the end of the commands block.
-
-// Returns -1 in case of the error, corresponding command block will be freed.
-static int add_eob(struct context* ctx, int idx, int sz);
-
-static int is_control_cmd(char* cmd);
-static char* cmd_by_state(int state);
-static int is_valid_cmd(struct context* ctx, char* cmd);
+/*
+ * wake_fds is the self-pipe of the event loop. The SIGCHLD handler and the
+ * finished builtin threads write to it, the loop wakes up and reaps the
+ * background jobs without blocking.
+ */
+static int wake_fds[2] = { -1, -1 };
 
+/* command is a command of a running pipeline */
 struct command {
-    char** args;
+    char** args; /* owned by the parsed node or by the job */
     int fd_in;
     int fd_out;
+    const struct builtin* builtin; /* NULL - an external command */
+    pthread_t thread;              /* runs the builtin */
+    int thread_running;            /* @thread has to be joined, atomic */
+    int done;                      /* the builtin has returned, under done_lock */
+    pid_t pid;                     /* -1 - no process was started */
+    int reaped;                    /* the process was waited for */
+    int status;
+};
+
+/* job is a pipeline run in the background with & */
+struct job {
+    int id;
+    struct arena mem; /* the commands, they outlive the parsed line */
+    struct command* cmds;
+    int len;
+    char* text; /* the command line for the notifications */
+    struct job* next;
+};
+
+static struct job* jobs = NULL;
+
+/*
+ * The commands of the foreground pipeline, Ctrl-C cancels their builtins.
+ * The builtin threads block SIGINT, so it always reaches the main thread,
+ * int_handler passes it on to them as SIGUSR1 and their blocked reads fail
+ * with EINTR. A thread is joined only once it's done and int_handler has
+ * been told to leave it alone, so it never signals a joined thread.
+ */
+static struct command* volatile fg_cmds = NULL;
+static volatile int fg_len = 0;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static int start_job(struct node* n);
+static struct job* new_job(struct node* n);
+static void reap_jobs(void);
+static void notify_jobs(void);
+static void finish_job(struct job* j, int* status);
+static int job_done(const struct job* j);
+static struct job* find_job(const char* spec);
+static void remove_job(struct job* j);
+
+/*
+ * input reads the commands from stdin by itself instead of stdio, so the
+ * shell can wait in poll for either the next line or a finished job.
+ */
+struct input {
+    char* buf;
+    size_t start; /* the beginning of the data that isn't returned yet */
+    size_t len;
+    size_t cap;
+    int eof;
 };
 
-static int is_pipeline(char* line);
-static int process_pipeline(char* line);
-static int free_commands(struct command* cmds, int len, int started_num);
-static int free_command(struct command* cmd);
-static int run_pipeline(struct command* cmds, int len);
-static int redirect_cmd_in_out(struct command* cmd);
+static int read_line(struct input* in, char** line);
+static int wait_input(void);
+
+static void init_command(struct command* cmd, char** args);
+static int close_commands(struct command* cmds, int len);
+static int close_command(struct command* cmd);
+static int run_pipeline(struct command* cmds, int len, int background);
+static int start_builtin(struct command* cmd);
+static void join_builtins(struct command* cmds, int len);
+static int run_builtin(struct command* cmd);
+static void* builtin_thread(void* p);
 
 int main(int ac, char* av[]) {
+    if (pipe2(wake_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("pipe2");
+        exit(EXIT_FAILURE);
+    }
+
     set_signals();
+    setlocale(LC_CTYPE, ""); /* for the widths of pwc -L */
 
     if ((tty_name = getlogin()) == NULL) {
         perror("getlogin");
@@ -93,559 +164,979 @@ int main(int ac, char* av[]) {
     if ((cur_dir = get_curr_dir()) == NULL)
         exit(EXIT_FAILURE);
 
-    char** arglist = NULL;
-    char** cmdline = NULL;
-    char** cp = NULL;
-    char* cmd = NULL;
+    struct input in;
     char* line = NULL;
-    size_t cap = 0;
+    int status = 0;
+    int ret = 0;
+
+    memset(&in, 0, sizeof(in));
 
-    struct context ctx;
-    empty_context(&ctx);
+    // the nodes of a line (or of the lines of an if) live in the arena until
+    // they are run, then they are dropped in one shot.
+    struct arena mem;
+    arena_init(&mem, 64 * 1024);
+    const struct arena_mark empty = arena_mark(&mem);
 
-    int idx = 0;
-    int sz = 1;
+    struct parser parser;
+    parser_init(&parser, &mem);
 
     for (;;) {
-        if (ctx.state == 0)
+        if (!parser_pending(&parser)) {
+            notify_jobs();
             prompt();
-        else
+        } else {
             printf("> ");
-
-        if (getline(&line, &cap, stdin) == -1) {
-            if (feof(stdin)) {
-                printf("exit\n");
-                break;
-            }
-            perror("getline");
-            goto error;
         }
+        fflush(stdout);
 
-        if (strcmp(line, "\n") == 0)
-            continue;
-
-        if (strncmp(line, "exit", 4) == 0) {
+        if ((ret = read_line(&in, &line)) == -1)
+            goto error;
+        if (ret == 0) {
             printf("exit\n");
             break;
         }
 
-        trim_suffix(line);
-
-        if (is_pipeline(line)) {
-            if (process_pipeline(line) == -1)
-                goto error;
+        if (parse_line(&parser, line) == -1) {
+            arena_release(&mem, empty);
             continue;
         }
 
-        if (is_control_cmd(line)) {
-            if (!is_valid_cmd(&ctx, line)) {
-                fprintf(stderr, "%s: invalid command `%s` after `%s`\n", av[0], line,
-                        cmd_by_state(ctx.state));
-                goto error;
-            }
-
-            if (ctx.state == def_state) {
-                set_context_state(line, &ctx);
-                continue;
-            }
-
-            if (add_eob(&ctx, idx, sz) == -1)
-                goto error;
-
-            set_context_state(line, &ctx);
-            if (ctx.state == fi_state) {
-                if (exec_context(&ctx) == -1)
-                    goto error;
-                free_context(&ctx);
-            }
-            idx = 0;
-            sz = 1;
-
+        if (parser_pending(&parser))
             continue;
-        }
 
-        if ((cmdline = list_from_line(line, ";", NULL)) == NULL)
+        ret = exec_list(parser.list, &status);
+        parser_reset(&parser);
+        arena_release(&mem, empty);
+        if (ret == -1)
             goto error;
 
-        if (ctx.state == def_state) {
-            if (exec_block(cmdline, NULL) == -1) {
-                free(cmdline);
-                goto error;
-            }
-
-            continue;
-        }
-
-        cp = cmdline;
-        while (*cp != NULL) {
-            if (add_cmd(&ctx, *cp, &sz, &idx) == -1)
-                goto error;
-            cp++;
+        if (exiting) {
+            printf("exit\n");
+            break;
         }
-        free(cmdline);
     }
 
-    free(line);
-    exit(EXIT_SUCCESS);
+    free(in.buf);
+    arena_free(&mem);
+    cmd_hash_free(&cmds_hash);
+    exit(exit_code);
 
 error:
-    free(line);
-    free_context(&ctx);
+    free(in.buf);
+    arena_free(&mem);
+    cmd_hash_free(&cmds_hash);
     exit(EXIT_FAILURE);
 }
 
-static int is_pipeline(char* line) {
-    return strchr(line, '|') != NULL;
+/**
+ * exec_list runs the nodes of the @n list one by one, @status is the status
+ * of the last one. Returns -1 in case of the error.
+ */
+static int exec_list(struct node* n, int* status) {
+    for (; n != NULL && !exiting; n = n->next) {
+        int ret = 0;
+        if (n->type == NODE_IF)
+            ret = exec_if(n, status);
+        else if (n->background)
+            ret = start_job(n);
+        else
+            ret = exec_pipeline(n, status);
+
+        if (ret == -1)
+            return -1;
+        if (n->background)
+            *status = 0;
+    }
+    return 0;
 }
 
 /**
- * process_pipeline parses the @line and creates a list of pipeline commands to
- * run.
+ * exec_if runs the then part of @n if its condition exits with 0 and the
+ * else part otherwise.
  */
-static int process_pipeline(char* line) {
-    int len = 0;
-    char** list = list_from_line(line, "|", &len);
-    if (list == NULL)
+static int exec_if(struct node* n, int* status) {
+    if (exec_list(n->cond, status) == -1)
         return -1;
 
-    struct command cmds[len];
-    int idx = 0;
+    if (WIFEXITED(*status) && WEXITSTATUS(*status) == 0)
+        return exec_list(n->then, status);
 
-    char** cp = list;
-    while (*cp != NULL) {
-        struct command c;
-        c.args = list_from_line(*cp, " ", NULL);
-        c.fd_in = -1;
-        c.fd_out = -1;
+    *status = 0;
+    return exec_list(n->els, status);
+}
+
+/**
+ * exec_pipeline runs the pipeline @n and waits until it's done, @status is
+ * the status of its last command.
+ */
+static int exec_pipeline(struct node* n, int* status) {
+    const int len = n->ncmds;
+    struct command cmds[len];
+    struct command_node* c = n->cmds;
+    int ret = 0;
+    int i = 0;
 
-        cmds[idx++] = c;
-        cp++;
+    if (len == 1 && strcmp(c->argv[0], "hash") == 0)
+        return builtin_hash(c->argv, status);
+    if (len == 1 && strcmp(c->argv[0], "exit") == 0)
+        return builtin_exit(c->argv, status);
+    if (len == 1 && strcmp(c->argv[0], "wait") == 0)
+        return builtin_wait(c->argv, status);
+
+    const char* name = shell_builtin(n);
+    if (name != NULL) {
+        fprintf(stderr, "sh: %s: can't run in a pipeline\n", name);
+        *status = W_EXITCODE(1, 0);
+        return 0;
     }
 
-    int i = 0;
-    for (; i < len - 1; i++) {
+    for (i = 0; i < len; i++, c = c->next)
+        init_command(&cmds[i], c->argv);
+
+    for (i = 0; i < len - 1; i++) {
         int fds[2];
-        if (pipe(fds) == -1) {
-            perror("pipe");
-            goto error;
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            close_commands(cmds, len);
+            return -1;
         }
         cmds[i].fd_out = fds[1];
         cmds[i + 1].fd_in = fds[0];
     }
 
-    int proc_num = 0;
-    if ((proc_num = run_pipeline(cmds, len)) == -1)
+    if (run_pipeline(cmds, len, 0) == -1)
+        ret = -1;
+
+    for (i = 0; i < len; i++) {
+        if (cmds[i].pid == -1)
+            continue;
+        while (waitpid(cmds[i].pid, &cmds[i].status, 0) == -1) {
+            if (errno != EINTR) {
+                perror("waitpid");
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    *status = cmds[len - 1].status;
+    return ret;
+}
+
+/**
+ * start_job runs the pipeline @n in the background. The job gets its own copy
+ * of the commands, the parsed line is dropped long before the job is done.
+ */
+static int start_job(struct node* n) {
+    struct job* j = NULL;
+    struct job** jp = &jobs;
+    int status = 0;
+    int i = 0;
+
+    const char* name = shell_builtin(n);
+    if (name != NULL) {
+        fprintf(stderr, "sh: %s: can't run in the background\n", name);
+        return 0;
+    }
+
+    if ((j = new_job(n)) == NULL)
+        return -1;
+
+    // a job doesn't read the terminal, the shell does.
+    if ((j->cmds[0].fd_in = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1) {
+        perror("open(/dev/null)");
         goto error;
+    }
 
-    while (proc_num-- != 0) {
-        if (wait(NULL) == -1) {
-            perror("wait");
+    for (; i < j->len - 1; i++) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            close_commands(j->cmds, j->len);
             goto error;
         }
+        j->cmds[i].fd_out = fds[1];
+        j->cmds[i + 1].fd_in = fds[0];
+    }
+
+    if (run_pipeline(j->cmds, j->len, 1) == -1) {
+        finish_job(j, &status);
+        goto error;
     }
 
-    free(list);
+    // the jobs are kept in the order of their ids.
+    for (; *jp != NULL; jp = &(*jp)->next)
+        j->id = (*jp)->id;
+    j->id++;
+    *jp = j;
+
+    // the pid of the last process, a job of builtins only has no process.
+    for (i = j->len - 1; i >= 0 && j->cmds[i].pid == -1; i--)
+        ;
+    if (i >= 0)
+        printf("[%d] %d\n", j->id, (int)j->cmds[i].pid);
+    else
+        printf("[%d] %s\n", j->id, j->text);
     return 0;
+
 error:
-    free_commands(cmds, len, proc_num);
-    free(list);
+    arena_free(&j->mem);
+    free(j);
     return -1;
 }
 
-/**
- * run_pipeline runs the pipeline specified in the @cmds. @len stands for the
- * number of commands to run in the pipeline. The caller is responsible for
- * waiting until all commands will be done.
- */
-static int run_pipeline(struct command* cmds, int len) {
-    int proc_num = 0;
-    pid_t pid = 0;
+static struct job* new_job(struct node* n) {
+    struct job* j = NULL;
+    struct command_node* c = NULL;
+    size_t text_len = 0;
+    char* t = NULL;
     int i = 0;
 
-    for (; i < len; i++) {
-        pid = fork();
-        if (pid == -1) {
-            perror("fork");
+    if ((j = malloc(sizeof(struct job))) == NULL) {
+        fprintf(stderr, "malloc, no memory\n");
+        return NULL;
+    }
+
+    arena_init(&j->mem, 4096);
+    j->id = 0;
+    j->len = n->ncmds;
+    j->next = NULL;
+
+    for (c = n->cmds; c != NULL; c = c->next) {
+        for (char** ap = c->argv; *ap != NULL; ap++)
+            text_len += strlen(*ap) + 1;
+        text_len += 3; /* " | " */
+    }
+
+    j->cmds = arena_alloc(&j->mem, j->len * sizeof(struct command));
+    t = j->text = arena_alloc(&j->mem, text_len + 1);
+    if (j->cmds == NULL || j->text == NULL)
+        goto error;
+
+    for (c = n->cmds; c != NULL; c = c->next, i++) {
+        int argc = 0;
+        while (c->argv[argc] != NULL)
+            argc++;
+
+        char** args = arena_alloc(&j->mem, (argc + 1) * sizeof(char*));
+        if (args == NULL)
             goto error;
-        } else if (pid == 0) {
-            if (redirect_cmd_in_out(&cmds[i]) == -1)
-                exit(EXIT_FAILURE);
 
-            if (execvp(cmds[i].args[0], cmds[i].args) == -1) {
-                fprintf(stderr, "sh: %s: command not found...\n", cmds[i].args[0]);
-                exit(EXIT_FAILURE);
-            }
-        } else {
-            if (free_command(&cmds[i]) == -1)
+        for (int k = 0; k < argc; k++) {
+            const char* arg = c->argv[k];
+            if ((args[k] = arena_strndup(&j->mem, arg, strlen(arg))) == NULL)
                 goto error;
-            proc_num++;
+
+            if (k > 0)
+                *t++ = ' ';
+            else if (i > 0)
+                t = stpcpy(t, " | ");
+            t = stpcpy(t, args[k]);
         }
+        args[argc] = NULL;
+
+        init_command(&j->cmds[i], args);
     }
 
-    return proc_num;
+    *t = '\0';
+    return j;
 
 error:
-    while (proc_num-- != 0) {
-        if (wait(NULL) == -1) {
-            perror("wait");
-        }
-    }
-    return -1;
+    arena_free(&j->mem);
+    free(j);
+    return NULL;
 }
 
 /**
- * redirect_cmd_in_out changes the stdin and stdout of the child process with
- * provided in the @cmd.
+ * reap_jobs collects the processes and the builtin threads of the background
+ * jobs that are done, it never blocks.
  */
-static int redirect_cmd_in_out(struct command* cmd) {
-    if (cmd->fd_in != -1) {
-        if (dup2(cmd->fd_in, STDIN_FILENO) == -1) {
-            perror("dup2");
-            goto error;
+static void reap_jobs(void) {
+    struct job* j = jobs;
+    int i = 0;
+
+    for (; j != NULL; j = j->next) {
+        for (i = 0; i < j->len; i++) {
+            struct command* c = &j->cmds[i];
+            pid_t pid = 0;
+            int st = 0;
+
+            if (c->pid != -1 && !c->reaped) {
+                if ((pid = waitpid(c->pid, &st, WNOHANG)) == -1) {
+                    perror("waitpid");
+                    c->reaped = 1;
+                } else if (pid != 0) {
+                    c->status = st;
+                    c->reaped = 1;
+                }
+            }
+
+            if (c->thread_running && __atomic_load_n(&c->done, __ATOMIC_ACQUIRE))
+                join_builtins(c, 1);
         }
+    }
+}
 
-        if (close(cmd->fd_in) == -1) {
-            perror("close");
-            cmd->fd_in = -1;
-            goto error;
+/* notify_jobs reports the finished background jobs and forgets them. */
+static void notify_jobs(void) {
+    struct job* j = jobs;
+
+    reap_jobs();
+    while (j != NULL) {
+        struct job* next = j->next;
+
+        if (job_done(j)) {
+            const int st = j->cmds[j->len - 1].status;
+            if (WIFSIGNALED(st))
+                printf("[%d]  %s\t%s\n", j->id, strsignal(WTERMSIG(st)), j->text);
+            else if (WEXITSTATUS(st) != 0)
+                printf("[%d]  Exit %d\t%s\n", j->id, WEXITSTATUS(st), j->text);
+            else
+                printf("[%d]  Done\t%s\n", j->id, j->text);
+            remove_job(j);
         }
+
+        j = next;
     }
+}
 
-    if (cmd->fd_out != -1) {
-        if (dup2(cmd->fd_out, STDOUT_FILENO) == -1) {
-            perror("dup2");
-            goto error;
+/**
+ * finish_job blocks until every process and thread of @j is done, @status is
+ * the status of its last command.
+ */
+static void finish_job(struct job* j, int* status) {
+    int i = 0;
+
+    for (; i < j->len; i++) {
+        struct command* c = &j->cmds[i];
+        if (c->pid != -1 && !c->reaped) {
+            while (waitpid(c->pid, &c->status, 0) == -1) {
+                if (errno != EINTR) {
+                    perror("waitpid");
+                    break;
+                }
+            }
+            c->reaped = 1;
         }
+    }
 
-        if (close(cmd->fd_out) == -1) {
-            perror("close");
-            cmd->fd_out = -1;
-            goto error;
+    join_builtins(j->cmds, j->len);
+    *status = j->cmds[j->len - 1].status;
+}
+
+static int job_done(const struct job* j) {
+    int i = 0;
+
+    for (; i < j->len; i++) {
+        const struct command* c = &j->cmds[i];
+        if ((c->pid != -1 && !c->reaped) || c->thread_running)
+            return 0;
+    }
+    return 1;
+}
+
+/* find_job returns the job given by @spec: %id or a pid of its processes. */
+static struct job* find_job(const char* spec) {
+    struct job* j = jobs;
+    int i = 0;
+
+    if (spec[0] == '%') {
+        const int id = atoi(spec + 1);
+        for (; j != NULL; j = j->next) {
+            if (j->id == id)
+                return j;
         }
+        return NULL;
     }
 
-    return 0;
+    const pid_t pid = atoi(spec);
+    for (; j != NULL; j = j->next) {
+        for (i = 0; i < j->len; i++) {
+            if (j->cmds[i].pid == pid)
+                return j;
+        }
+    }
+    return NULL;
+}
 
-error:
-    if (cmd->fd_in != -1)
-        if (close(cmd->fd_in) == -1)
-            perror("close");
+static void remove_job(struct job* j) {
+    struct job** jp = &jobs;
 
-    if (cmd->fd_out != -1)
-        if (close(cmd->fd_out) == -1)
-            perror("close");
+    while (*jp != j)
+        jp = &(*jp)->next;
+    *jp = j->next;
 
-    return -1;
+    arena_free(&j->mem);
+    free(j);
 }
 
 /**
- * free_commands frees the argument list of the command and closes both end of
- * the pipe. @started_num stands for number of successfully running procs, no
- * need to free such commands.
+ * run_pipeline starts the pipeline specified in the @cmds. @len stands for the
+ * number of commands in the pipeline. A builtin runs in a thread of the
+ * shell, or right in the calling thread if it's the last command of a
+ * foreground pipeline. The processes of a @background pipeline get their own
+ * process group, Ctrl-C of the terminal doesn't reach them, it cancels only
+ * the builtins of the foreground one. The pipe ends are closed. The caller is
+ * responsible for waiting until the started processes (and the threads of a
+ * @background pipeline) are done.
  */
-static int free_commands(struct command* cmds, int len, int started_num) {
-    int n = len - started_num - 1;
+static int run_pipeline(struct command* cmds, int len, int background) {
+    pid_t pgid = background ? 0 : -1;
     int i = 0;
-    for (; i < n; i++) {
-        if (free_command(&cmds[i]) == -1)
-            return -1;
+
+    if (!background) {
+        reader_cancel = 0;
+        fg_len = len;
+        fg_cmds = cmds;
     }
-    return 0;
-}
 
-static int free_command(struct command* cmd) {
-    free(cmd->args);
-    if (cmd->fd_in != -1) {
-        if (close(cmd->fd_in) == -1) {
-            perror("close");
-            cmd->fd_in = -1;
-            goto error;
+    for (; i < len; i++) {
+        if (cmds[i].builtin != NULL && i == len - 1 && !background) {
+            cmds[i].status = W_EXITCODE(run_builtin(&cmds[i]), 0);
+            continue;
         }
-    }
 
-    if (cmd->fd_out != -1) {
-        if (close(cmd->fd_out) == -1) {
-            perror("close");
-            cmd->fd_out = -1;
-            goto error;
+        if (cmds[i].builtin != NULL) {
+            if (start_builtin(&cmds[i]) == -1)
+                goto error;
+            continue;
         }
+
+        if (spawn(cmds[i].args, cmds[i].fd_in, cmds[i].fd_out, pgid, &cmds[i].pid,
+                  &cmds[i].status)
+            == -1)
+            goto error;
+        if (cmds[i].pid != -1 && pgid == 0)
+            pgid = cmds[i].pid;
+
+        if (close_command(&cmds[i]) == -1)
+            goto error;
     }
 
+    if (!background) {
+        join_builtins(cmds, len);
+        fg_cmds = NULL;
+        fg_len = 0;
+    }
     return 0;
 
 error:
-    if (cmd->fd_in != -1)
-        if (close(cmd->fd_in) == -1)
-            perror("close");
-
-    if (cmd->fd_out != -1)
-        if (close(cmd->fd_out) == -1)
-            perror("close");
-
+    // the pipe ends of the commands that didn't start let the started ones
+    // see EOF or EPIPE and finish.
+    close_commands(cmds + i, len - i);
+    join_builtins(cmds, i);
+    fg_cmds = NULL;
+    fg_len = 0;
     return -1;
 }
 
-static int execute(char** av, int* status) {
-    pid_t pid = 0;
+/*
+ * start_builtin runs the builtin of @cmd in a new thread. The thread blocks
+ * SIGINT and SIGQUIT, only the ones of the foreground pipeline are cancelled,
+ * see int_handler.
+ */
+static int start_builtin(struct command* cmd) {
+    sigset_t set, old;
+    int ret = 0;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGQUIT);
 
-    pid = fork();
-    if (pid == -1) {
-        perror("fork");
+    // the thread inherits the mask.
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    ret = pthread_create(&cmd->thread, NULL, builtin_thread, cmd);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(ret));
         return -1;
-    } else if (pid == 0) {
-        if (execvp(av[0], av) == -1) {
-            fprintf(stderr, "sh: %s: command not found...\n", av[0]);
-            return -1;
-        }
-    } else {
-        if (wait(status) == -1) {
-            perror("wait");
-            return -1;
-        }
     }
-
+    __atomic_store_n(&cmd->thread_running, 1, __ATOMIC_SEQ_CST);
     return 0;
 }
 
-static char** init_list(int sz) {
-    char** al = (char**)malloc(sz * sizeof(char*));
-    if (al == NULL) {
-        fprintf(stderr, "malloc, no memory\n");
-        return NULL;
+/*
+ * join_builtins waits for the builtin threads among the @len @cmds. Ctrl-C
+ * still reaches a thread while it's waited for, the flag int_handler checks
+ * is cleared only when the builtin has returned.
+ */
+static void join_builtins(struct command* cmds, int len) {
+    int ret = 0;
+    int i = 0;
+
+    for (; i < len; i++) {
+        if (!__atomic_load_n(&cmds[i].thread_running, __ATOMIC_SEQ_CST))
+            continue;
+
+        pthread_mutex_lock(&done_lock);
+        while (!cmds[i].done)
+            pthread_cond_wait(&done_cond, &done_lock);
+        pthread_mutex_unlock(&done_lock);
+
+        __atomic_store_n(&cmds[i].thread_running, 0, __ATOMIC_SEQ_CST);
+        if ((ret = pthread_join(cmds[i].thread, NULL)) != 0)
+            fprintf(stderr, "pthread_join: %s\n", strerror(ret));
     }
-    return al;
 }
 
-static char** list_from_line(char* line, const char* delim, int* count) {
-    int sz = 1;
-    char** al = init_list(sz);
-    if (al == NULL)
-        goto error;
-
-    char** cp = NULL;
-    int idx = 0;
-    int len = 0;
+/**
+ * run_builtin runs the builtin of @cmd in the calling thread with the pipe
+ * ends of @cmd as its stdin and stdout, they are closed when it's done.
+ * SIGPIPE is blocked meanwhile: when the reader is gone the builtin gets
+ * EPIPE and stops, it mustn't kill the whole shell. Returns the exit status.
+ */
+static int run_builtin(struct command* cmd) {
+    const struct timespec zero = { 0, 0 };
+    sigset_t pipe_set, old;
+    FILE* in = stdin;
+    FILE* out = stdout;
+    int code = EXIT_FAILURE;
 
-    char* p = NULL;
-    char* q = NULL;
-    for (q = line; (p = strtok(q, delim)) != NULL; q = NULL) {
-        if (idx == sz) {
-            sz *= 2;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old);
 
-            cp = realloc(al, sz * sizeof(char*));
-            if (cp == NULL) {
-                fprintf(stderr, "realloc, no memory\n");
-                goto error;
-            }
-            al = cp;
+    if (cmd->fd_in != -1) {
+        if ((in = fdopen(cmd->fd_in, "r")) == NULL) {
+            perror("fdopen");
+            goto out;
         }
-
-        al[idx++] = p;
+        cmd->fd_in = -1;
     }
 
-    if (idx == sz) {
-        cp = realloc(al, (sz + 1) * sizeof(char*));
-        if (cp == NULL) {
-            fprintf(stderr, "realloc, no memory\n");
-            goto error;
+    if (cmd->fd_out != -1) {
+        if ((out = fdopen(cmd->fd_out, "w")) == NULL) {
+            perror("fdopen");
+            goto out;
         }
-        al = cp;
+        cmd->fd_out = -1;
     }
 
-    if (count != NULL)
-        *count = idx;
+    code = cmd->builtin->run(cmd->args, in, out);
+    if (reader_cancel)
+        code = 128 + SIGINT;
+
+out:
+    if (in == stdin)
+        clearerr(stdin); // EOF of the builtin isn't the shell's one
+    else if (in != NULL && fclose(in) == EOF)
+        perror("fclose");
+
+    if (out == stdout) {
+        if (fflush(stdout) == EOF && errno != EPIPE)
+            perror("fflush");
+        clearerr(stdout);
+    } else if (out != NULL && fclose(out) == EOF && errno != EPIPE) {
+        perror("fclose");
+    }
 
-    al[idx] = NULL;
-    return al;
+    if (cmd->fd_in != -1 && close(cmd->fd_in) == -1)
+        perror("close");
+    if (cmd->fd_out != -1 && close(cmd->fd_out) == -1)
+        perror("close");
+    cmd->fd_in = -1;
+    cmd->fd_out = -1;
+
+    // a write to the gone reader left SIGPIPE pending, drop it.
+    while (sigtimedwait(&pipe_set, NULL, &zero) > 0)
+        ;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return code;
+}
 
-error:
-    free(al);
+static void* builtin_thread(void* p) {
+    struct command* cmd = (struct command*)p;
+    cmd->status = W_EXITCODE(run_builtin(cmd), 0);
+
+    pthread_mutex_lock(&done_lock);
+    __atomic_store_n(&cmd->done, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&done_cond);
+    pthread_mutex_unlock(&done_lock);
+    wake();
     return NULL;
 }
 
-static void empty_context(struct context* ctx) {
-    ctx->if_block = NULL;
-    ctx->then_block = NULL;
-    ctx->else_block = NULL;
-    ctx->state = def_state;
+static void init_command(struct command* cmd, char** args) {
+    cmd->args = args;
+    cmd->fd_in = -1;
+    cmd->fd_out = -1;
+    cmd->builtin = builtin_find(args);
+    cmd->thread_running = 0;
+    cmd->done = 0;
+    cmd->pid = -1;
+    cmd->reaped = 0;
+    cmd->status = 0;
 }
 
-static void set_context_state(const char* cmd, struct context* ctx) {
-    if (strcmp(cmd, "if") == 0)
-        ctx->state = if_state;
-    else if (strcmp(cmd, "then") == 0)
-        ctx->state = then_state;
-    else if (strcmp(cmd, "else") == 0)
-        ctx->state = else_state;
-    else if (strcmp(cmd, "fi") == 0)
-        ctx->state = fi_state;
-    else
-        return;
+/**
+ * close_commands closes the pipe ends the @len commands still hold. A closed
+ * command can be closed again.
+ */
+static int close_commands(struct command* cmds, int len) {
+    int ret = 0;
+    int i = 0;
+    for (; i < len; i++) {
+        if (close_command(&cmds[i]) == -1)
+            ret = -1;
+    }
+    return ret;
 }
 
-static int is_control_cmd(char* cmd) {
-    return (strcmp(cmd, "if") == 0 || strcmp(cmd, "then") == 0 || strcmp(cmd, "else") == 0
-            || strcmp(cmd, "fi") == 0);
-}
+static int close_command(struct command* cmd) {
+    int ret = 0;
 
-static char* cmd_by_state(int state) {
-    if (state == if_state)
-        return "if";
-    if (state == then_state)
-        return "then";
-    if (state == else_state)
-        return "else";
-    if (state == fi_state)
-        return "fi";
-    return NULL;
-}
+    if (cmd->fd_in != -1 && close(cmd->fd_in) == -1) {
+        perror("close");
+        ret = -1;
+    }
 
-static int is_valid_cmd(struct context* ctx, char* cmd) {
-    if (strcmp(cmd, "if") == 0)
-        return ctx->state == def_state;
-    if (strcmp(cmd, "then") == 0)
-        return ctx->state == if_state && ctx->if_block != NULL;
-    if (strcmp(cmd, "else") == 0)
-        return ctx->state == then_state && ctx->if_block != NULL;
+    if (cmd->fd_out != -1 && close(cmd->fd_out) == -1) {
+        perror("close");
+        ret = -1;
+    }
 
-    return -1;
+    cmd->fd_in = -1;
+    cmd->fd_out = -1;
+    return ret;
 }
 
-static int add_cmd(struct context* ctx, char* cmd, int* sz, int* idx) {
-    char** cp = NULL;
-    char** blk = block_by_state(ctx);
-
-    if (blk == NULL) {
-        if ((cp = init_list(*sz)) == NULL)
-            return -1;
-        blk = cp;
-        set_block_by_state(ctx, blk);
+/**
+ * spawn starts @av with stdin and stdout replaced by @fd_in and @fd_out, -1
+ * keeps the shell's one. posix_spawn doesn't copy the shell's page tables the
+ * way fork does, so a launch costs the same whatever the shell's size is. The
+ * pipe ends are close-on-exec, the child keeps only the ends it's dup'ed.
+ * The command is found through cmds_hash, a remembered path that is gone is
+ * forgotten and searched again. The process joins the @pgid process group,
+ * 0 - a new one, -1 - the shell's one. A command that can't be started is
+ * reported, @pid is -1 then and @status is 127 if it isn't found, 126
+ * otherwise. Returns -1 if the spawn attributes can't be set up.
+ */
+static int spawn(char** av, int fd_in, int fd_out, pid_t pgid, pid_t* pid, int* status) {
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    const char* path = NULL;
+    int err = 0;
+
+    *pid = -1;
+    if ((err = posix_spawn_file_actions_init(&fa)) != 0) {
+        fprintf(stderr, "posix_spawn_file_actions_init: %s\n", strerror(err));
+        return -1;
+    }
+    if ((err = posix_spawnattr_init(&attr)) != 0) {
+        fprintf(stderr, "posix_spawnattr_init: %s\n", strerror(err));
+        posix_spawn_file_actions_destroy(&fa);
+        return -1;
     }
 
-    if (*idx == *sz) {
-        *sz *= 2;
-        if ((cp = realloc(blk, *sz * sizeof(char*))) == NULL) {
-            fprintf(stderr, "realloc, no memory\n");
-            return -1;
+    if (pgid != -1
+        && ((err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP)) != 0
+            || (err = posix_spawnattr_setpgroup(&attr, pgid)) != 0))
+        goto error;
+
+    if (fd_in != -1
+        && (err = posix_spawn_file_actions_adddup2(&fa, fd_in, STDIN_FILENO)) != 0)
+        goto error;
+    if (fd_out != -1
+        && (err = posix_spawn_file_actions_adddup2(&fa, fd_out, STDOUT_FILENO)) != 0)
+        goto error;
+
+    for (int retry = 1;; retry--) {
+        if ((path = cmd_hash_lookup(&cmds_hash, av[0])) == NULL) {
+            err = errno;
+            break;
         }
-        blk = cp;
-        set_block_by_state(ctx, blk);
-    }
 
-    char* cmd_cp = malloc(sizeof(cmd) / sizeof(char));
-    strcpy(cmd_cp, cmd);
+        if ((err = posix_spawn(pid, path, &fa, &attr, av, environ)) == ENOEXEC)
+            err = spawn_script(pid, path, &fa, &attr, av);
+        if (err == 0)
+            break;
+        *pid = -1;
+        if (err != ENOENT || !retry || path == av[0])
+            break;
+        cmd_hash_forget(&cmds_hash, av[0]);
+    }
 
-    blk[*idx] = cmd_cp;
-    *idx += 1;
+    if (err == ENOENT) {
+        fprintf(stderr, "sh: %s: command not found...\n", av[0]);
+        *status = W_EXITCODE(127, 0);
+    } else if (err != 0) {
+        fprintf(stderr, "sh: %s: %s\n", av[0], strerror(err));
+        *status = W_EXITCODE(126, 0);
+    }
 
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
     return 0;
+
+error:
+    fprintf(stderr, "posix_spawn(%s): %s\n", av[0], strerror(err));
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    return -1;
 }
 
-static int exec_context(struct context* ctx) {
-    int status = 0;
-    if (exec_block(ctx->if_block, &status) == -1)
-        return -1;
+/*
+ * spawn_script runs @path that isn't an executable image as a script of
+ * /bin/sh, the way execvp does. Returns the posix_spawn error.
+ */
+static int spawn_script(pid_t* pid,
+                        const char* path,
+                        const posix_spawn_file_actions_t* fa,
+                        const posix_spawnattr_t* attr,
+                        char** av) {
+    size_t n = 1;
+    while (av[n] != NULL)
+        n++;
+
+    char** sav = malloc((n + 2) * sizeof(char*));
+    if (sav == NULL)
+        return ENOMEM;
+    sav[0] = "/bin/sh";
+    sav[1] = (char*)path;
+    memcpy(sav + 2, av + 1, n * sizeof(char*)); /* with the NULL */
+
+    int err = posix_spawn(pid, "/bin/sh", fa, attr, sav, environ);
+    free(sav);
+    return err;
+}
 
-    if (WIFEXITED(status)) {
-        if (exec_block(ctx->then_block, &status) == -1)
-            return -1;
+/*
+ * shell_builtin returns the name of the first command of @n that is a builtin
+ * of the shell itself, NULL if there is none. They change the state of the
+ * shell, so they run only as the single command of a foreground pipeline.
+ */
+static const char* shell_builtin(struct node* n) {
+    static const char* names[] = { "hash", "exit", "wait" };
+
+    for (struct command_node* c = n->cmds; c != NULL; c = c->next) {
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            if (strcmp(c->argv[0], names[i]) == 0)
+                return names[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * builtin_hash prints the remembered commands, forgets all of them with -r or
+ * looks up the commands given in @av.
+ */
+static int builtin_hash(char** av, int* status) {
+    int code = 0;
+
+    if (av[1] == NULL) {
+        cmd_hash_print(&cmds_hash, stdout);
+    } else if (strcmp(av[1], "-r") == 0) {
+        cmd_hash_free(&cmds_hash);
     } else {
-        if (exec_block(ctx->else_block, &status) == -1)
-            return -1;
+        for (char** cp = av + 1; *cp != NULL; cp++) {
+            if (cmd_hash_lookup(&cmds_hash, *cp) != NULL)
+                continue;
+            if (errno != ENOENT)
+                return -1;
+            fprintf(stderr, "sh: hash: %s: not found\n", *cp);
+            code = 1;
+        }
     }
 
+    fflush(stdout);
+    if (status != NULL)
+        *status = W_EXITCODE(code, 0);
     return 0;
 }
 
-static void free_context(struct context* ctx) {
-    if (ctx->if_block != NULL) {
-        free_block(ctx->if_block);
-    }
-    if (ctx->else_block != NULL) {
-        free_block(ctx->else_block);
+/**
+ * builtin_exit makes the shell exit after the current line with the status
+ * given in @av or with the one of the last command.
+ */
+static int builtin_exit(char** av, int* status) {
+    exiting = 1;
+    if (av[1] != NULL)
+        exit_code = atoi(av[1]);
+    else
+        exit_code = WIFEXITED(*status) ? WEXITSTATUS(*status) : EXIT_FAILURE;
+    return 0;
+}
+
+/**
+ * builtin_wait waits until the background jobs given in @av (%id or a pid of
+ * one of their processes) or all of them are done, @status is the status of
+ * the last given job.
+ */
+static int builtin_wait(char** av, int* status) {
+    *status = 0;
+
+    if (av[1] == NULL) {
+        while (jobs != NULL) {
+            finish_job(jobs, status);
+            remove_job(jobs);
+        }
+        *status = 0;
+        return 0;
     }
-    if (ctx->then_block != NULL) {
-        free_block(ctx->then_block);
+
+    for (char** ap = av + 1; *ap != NULL; ap++) {
+        struct job* j = find_job(*ap);
+        if (j == NULL) {
+            fprintf(stderr, "sh: wait: %s: no such job\n", *ap);
+            *status = W_EXITCODE(127, 0);
+            continue;
+        }
+
+        finish_job(j, status);
+        remove_job(j);
     }
-    empty_context(ctx);
-}
 
-static char** block_by_state(struct context* ctx) {
-    if (ctx->state == if_state)
-        return ctx->if_block;
-    else if (ctx->state == else_state)
-        return ctx->else_block;
-    else if (ctx->state == then_state)
-        return ctx->then_block;
-    else
-        return NULL;
+    return 0;
 }
 
-static void set_block_by_state(struct context* ctx, char** blk) {
-    if (ctx->state == if_state)
-        ctx->if_block = blk;
-    else if (ctx->state == else_state)
-        ctx->else_block = blk;
-    else if (ctx->state == then_state)
-        ctx->then_block = blk;
-    else
-        return;
-}
+/**
+ * read_line returns the next line of stdin without the newline in @line, it
+ * stays valid until the next call. The background jobs are reaped while the
+ * shell waits for the input. Returns 0 at EOF, -1 in case of the error.
+ */
+static int read_line(struct input* in, char** line) {
+    for (;;) {
+        const size_t unread = in->len - in->start;
+        char* nl = unread > 0 ? memchr(in->buf + in->start, '\n', unread) : NULL;
+
+        if (nl != NULL) {
+            *nl = '\0';
+            *line = in->buf + in->start;
+            in->start = nl - in->buf + 1;
+            return 1;
+        }
 
-static int add_eob(struct context* ctx, int idx, int sz) {
-    char** blk = block_by_state(ctx);
-    if (idx == sz) {
-        char** cp = realloc(blk, (sz + 1) * sizeof(char*));
-        if (cp == NULL) {
-            fprintf(stderr, "realloc, no memory\n");
+        if (in->eof) {
+            if (unread == 0)
+                return 0;
+            // the last line has no newline, there is always room for the NUL.
+            in->buf[in->len] = '\0';
+            *line = in->buf + in->start;
+            in->start = in->len;
+            return 1;
+        }
 
-            int i = 0;
-            for (; i < idx; i++) {
-                free(*blk++);
+        // keep the unread data at the beginning, grow the buffer if it's full.
+        if (in->start > 0) {
+            memmove(in->buf, in->buf + in->start, unread);
+            in->len = unread;
+            in->start = 0;
+        }
+        if (in->len + 1 >= in->cap) {
+            size_t cap = in->cap == 0 ? 4096 : in->cap * 2;
+            char* buf = realloc(in->buf, cap);
+            if (buf == NULL) {
+                fprintf(stderr, "realloc, no memory\n");
+                return -1;
             }
-            free(blk);
-            set_block_by_state(ctx, NULL);
+            in->buf = buf;
+            in->cap = cap;
+        }
+
+        if (wait_input() == -1)
+            return -1;
+
+        ssize_t n = read(STDIN_FILENO, in->buf + in->len, in->cap - in->len - 1);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("read");
             return -1;
         }
-        blk = cp;
-        set_block_by_state(ctx, blk);
+
+        if (n == 0)
+            in->eof = 1;
+        in->len += n;
     }
-    blk[idx] = NULL;
-    return 0;
 }
 
-static int exec_block(char** blk, int* status) {
-    char** arglist = NULL;
-    while (*blk != NULL) {
-        if ((arglist = list_from_line(*blk, " ", NULL)) == NULL)
-            return -1;
+/**
+ * wait_input is the event loop of the shell: it blocks until stdin has
+ * something to read and reaps the background jobs that finish meanwhile.
+ */
+static int wait_input(void) {
+    struct pollfd fds[2];
+    char buf[64];
+
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_fds[0];
+    fds[1].events = POLLIN;
 
-        if (execute(arglist, status) == -1) {
-            free(arglist);
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
             return -1;
         }
 
-        blk++;
-        free(arglist);
+        if (fds[1].revents & POLLIN) {
+            while (read(wake_fds[0], buf, sizeof(buf)) > 0)
+                ;
+            reap_jobs();
+        }
+
+        if (fds[0].revents != 0)
+            return 0;
     }
+}
 
-    return 0;
+static void set_signals(void) {
+    signal(SIGQUIT, sig_handler);
+
+    // no SA_RESTART, a builtin blocked in a read sees EINTR and stops.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = int_handler;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) == -1)
+        perror("sigaction");
+    sa.sa_handler = cancel_handler;
+    if (sigaction(SIGUSR1, &sa, NULL) == -1)
+        perror("sigaction");
+
+    // the foreground waits are restarted, the event loop sees EINTR of poll.
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = chld_handler;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGCHLD, &sa, NULL) == -1)
+        perror("sigaction");
 }
 
-static void free_block(char** blk) {
-    char** cp = blk;
-    while (*cp != NULL) {
-        free(*cp++);
+static void chld_handler(int signum) {
+    (void)signum;
+    wake();
+}
+
+/* wake makes the event loop reap the jobs, it's async-signal-safe. */
+static void wake(void) {
+    const int saved = errno;
+    // EAGAIN is fine, a full pipe already has a wake-up in it.
+    while (write(wake_fds[1], "", 1) == -1 && errno == EINTR)
+        ;
+    errno = saved;
+}
+
+/* int_handler cancels the builtins of the foreground pipeline. */
+static void int_handler(int signum) {
+    struct command* cmds = fg_cmds;
+
+    reader_cancel = 1;
+    for (int i = 0; cmds != NULL && i < fg_len; i++) {
+        if (__atomic_load_n(&cmds[i].thread_running, __ATOMIC_SEQ_CST))
+            pthread_kill(cmds[i].thread, SIGUSR1);
     }
-    free(blk);
+
+    sig_handler(signum);
 }
 
-static void set_signals(void) {
-    int sigs[] = { SIGINT, SIGQUIT };
-    const int sig_num = sizeof(sigs) / sizeof(int);
-    int i = 0;
-    for (; i < sig_num; i++)
-        signal(sigs[i], sig_handler);
+static void cancel_handler(int signum) {
+    (void)signum;
+    reader_cancel = 1;
 }
 
 static void sig_handler(int signum) {
@@ -689,7 +1180,3 @@ static char* get_curr_dir(void) {
 
     return dir;
 }
-
-static void trim_suffix(char* s) {
-    s[strlen(s) - 1] = '\0';
-}
@@ -131,68 +131,28 @@ error:
 }
 
 static int read_stdin_tail(struct read_config* conf) {
-    FILE* tmp = tmpfile();
-    if (tmp == NULL) {
-        perror("tmpfile");
-        goto error;
-    }
-
-    if (write_from_to(stdin, tmp) == -1)
-        goto error;
+    FILE* tmp = spool(stdin);
+    if (tmp == NULL)
+        return -1;
 
     if (conf->read_file(tmp) == -1)
         goto error;
 
     if (fclose(tmp) == -1) {
         perror("fclose");
-        goto error;
+        return -1;
     }
 
     return 0;
 
 error:
-    if (tmp != NULL) {
-        if (fclose(tmp) == -1) {
-            perror("fclose");
-        }
-    }
+    if (fclose(tmp) == -1)
+        perror("fclose");
     return -1;
 }
 
 static int read_tail_lines(FILE* f) {
-    int c = 0;
-    int n = 0;
-    int nc = 0; /* number of characters to print */
-
-    if (fseek(f, 0, SEEK_END) == -1) {
-        perror("fseek");
-        return -1;
-    }
-
-    do {
-        if (fseek(f, -1, SEEK_CUR) == -1) {
-            // the beginning of the file was reached, it's time to break
-            break;
-        }
-
-        c = getc(f);
-        if (ferror(f) != 0) {
-            perror("getc");
-            return -1;
-        }
-
-        if (c == '\n' && (++n == (nlines + 1)))
-            continue;
-
-        nc++;
-        if (ungetc(c, f) == EOF) {
-            perror("ungetc");
-            return -1;
-        }
-
-    } while (n != (nlines + 1));
-
-    return read_and_print_bytes(f, nc);
+    return tail_lines(f, stdout, nlines);
 }
 
 static int read_tail_bytes(FILE* f) {
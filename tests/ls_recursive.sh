@@ -0,0 +1,31 @@
+#!/bin/sh
+# -R lists a tree with symlinks to directories, one of them to a parent,
+# and must not descend into any of them.
+# Usage: tests/ls_recursive.sh [path/to/ls]
+
+LS=$(realpath "${1:-./ls}")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cd "$dir" || exit 1
+mkdir -p a/sub/deep
+touch a/f a/sub/g
+ln -s sub a/link
+ln -s .. a/sub/loop
+
+want='a:
+f
+link
+sub
+a/sub:
+deep
+g
+loop
+a/sub/deep:'
+got=$(timeout 20 "$LS" -R a)
+
+if [ "$got" != "$want" ]; then
+    printf 'FAIL: got\n%s\nwant\n%s\n' "$got" "$want"
+    exit 1
+fi
+echo "ok"
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Counts a file through the cache, rewrites it in the middle keeping its size
+# and its sampled windows, and checks that the counts follow the new content.
+# Usage: tests/pwc_cache.sh [path/to/pwc]
+
+PWC=${1:-./pwc}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+status=0
+
+check() {
+    want=$(wc -l -w -c <"$dir/f" | awk '{ print $1, $2, $3 }')
+    got=$("$PWC" -C "$dir/cache" "$dir/f" | awk '{ print $1, $2, $3 }')
+    if [ "$got" != "$want" ]; then
+        echo "FAIL: $1: got '$got', want '$want'"
+        status=1
+    fi
+}
+
+yes 'a few words' | head -c 65536 >"$dir/f"
+check "first run"
+check "cached"
+
+# the same size, the first and the last 4K untouched.
+{
+    head -c 8192 "$dir/f"
+    yes 'abcdefghijk' | head -c 32768
+    tail -c 24576 "$dir/f"
+} >"$dir/g"
+cat "$dir/g" >"$dir/f"
+check "same size rewrite"
+
+yes 'a few words' | head -c 4096 >>"$dir/f"
+check "appended"
+
+[ $status -eq 0 ] && echo "ok"
+exit $status
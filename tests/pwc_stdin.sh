@@ -0,0 +1,21 @@
+#!/bin/sh
+# Counts stdin of sizes around the multiples of the 1M ring buffers, the
+# exact multiples of at least 16 parts used to hang, and compares with wc.
+# Usage: tests/pwc_stdin.sh [path/to/pwc]
+
+PWC=${1:-./pwc}
+MB=1048576
+status=0
+
+for n in 0 1 $((MB - 1)) $MB $((MB + 1)) $((16 * MB - 1)) $((16 * MB)) \
+    $((16 * MB + 1)) $((17 * MB)) $((32 * MB)); do
+    want=$(yes 'a few words' | head -c $n | wc -l -w -c | awk '{ print $1, $2, $3 }')
+    got=$(yes 'a few words' | head -c $n | timeout 20 "$PWC" | awk '{ print $1, $2, $3 }')
+    if [ "$got" != "$want" ]; then
+        echo "FAIL: $n bytes: got '$got', want '$want'"
+        status=1
+    fi
+done
+
+[ $status -eq 0 ] && echo "ok"
+exit $status
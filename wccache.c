@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "wccache.h"
+
+static const char CACHE_MAGIC[] = "pwc-cache 3\n";
+
+static struct wc_cache_entry* lookup(const struct wc_cache* c, dev_t dev, ino_t ino);
+static int grow(struct wc_cache* c);
+static int sample(int fd, uintmax_t bytes, uint64_t* head, uint64_t* tail);
+static int same_time(const struct timespec* a, const struct timespec* b);
+
+int wc_cache_load(struct wc_cache* c, const char* path) {
+    char line[640];
+    FILE* f = NULL;
+    int lineno = 1;
+
+    memset(c, 0, sizeof(*c));
+
+    if ((f = fopen(path, "r")) == NULL) {
+        if (errno == ENOENT)
+            return 0;
+        fprintf(stderr, "fopen(%s): %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // a cache of an unknown format is dropped, it's rebuilt by this run.
+    if (fgets(line, sizeof(line), f) == NULL || strcmp(line, CACHE_MAGIC) != 0)
+        goto out;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        struct wc_cache_entry e;
+        uintmax_t dev = 0, ino = 0;
+        intmax_t msec = 0, csec = 0;
+        lineno++;
+
+        memset(&e, 0, sizeof(e));
+        int n = sscanf(line,
+                       "%ju %ju %u %ju %ju %ju %ju %ju %ju %d %d %u %d %" SCNx64
+                       " %" SCNx64 " %jd %ld %jd %ld",
+                       &dev, &ino, &e.what, &e.cnt.lines, &e.cnt.words, &e.cnt.chars,
+                       &e.cnt.bytes, &e.cnt.maxlen, &e.cnt.col, &e.cnt.in_word,
+                       &e.cnt.head_word, &e.cnt.wc, &e.cnt.wc_need, &e.head, &e.tail,
+                       &msec, &e.mtime.tv_nsec, &csec, &e.ctime.tv_nsec);
+        if (n != 19 || e.what == 0) {
+            fprintf(stderr, "%s:%d: malformed cache entry, skipped\n", path, lineno);
+            continue;
+        }
+
+        e.dev = dev;
+        e.ino = ino;
+        e.mtime.tv_sec = msec;
+        e.ctime.tv_sec = csec;
+        if (wc_cache_put(c, &e) == -1)
+            goto error;
+    }
+
+    if (ferror(f)) {
+        fprintf(stderr, "fgets(%s): %s\n", path, strerror(errno));
+        goto error;
+    }
+
+out:
+    if (fclose(f) == EOF) {
+        fprintf(stderr, "fclose(%s): %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+
+error:
+    fclose(f);
+    wc_cache_free(c);
+    return -1;
+}
+
+int wc_cache_save(const struct wc_cache* c, const char* path) {
+    char* tmp = NULL;
+    FILE* f = NULL;
+
+    if (asprintf(&tmp, "%s.tmp", path) == -1) {
+        fprintf(stderr, "asprintf, no memory\n");
+        return -1;
+    }
+
+    if ((f = fopen(tmp, "w")) == NULL) {
+        fprintf(stderr, "fopen(%s): %s\n", tmp, strerror(errno));
+        goto error;
+    }
+
+    fputs(CACHE_MAGIC, f);
+    for (size_t i = 0; i < c->cap; i++) {
+        const struct wc_cache_entry* e = &c->slots[i];
+        if (e->what == 0)
+            continue;
+
+        fprintf(f,
+                "%ju %ju %u %ju %ju %ju %ju %ju %ju %d %d %u %d %016" PRIx64 " %016" PRIx64
+                " %jd %ld %jd %ld\n",
+                (uintmax_t)e->dev, (uintmax_t)e->ino, e->what, e->cnt.lines, e->cnt.words,
+                e->cnt.chars, e->cnt.bytes, e->cnt.maxlen, e->cnt.col, e->cnt.in_word,
+                e->cnt.head_word, e->cnt.wc, e->cnt.wc_need, e->head, e->tail,
+                (intmax_t)e->mtime.tv_sec, e->mtime.tv_nsec, (intmax_t)e->ctime.tv_sec,
+                e->ctime.tv_nsec);
+    }
+
+    if (fclose(f) == EOF) {
+        fprintf(stderr, "fclose(%s): %s\n", tmp, strerror(errno));
+        f = NULL;
+        goto error;
+    }
+    f = NULL;
+
+    if (rename(tmp, path) == -1) {
+        fprintf(stderr, "rename(%s, %s): %s\n", tmp, path, strerror(errno));
+        goto error;
+    }
+
+    free(tmp);
+    return 0;
+
+error:
+    if (f != NULL)
+        fclose(f);
+    unlink(tmp);
+    free(tmp);
+    return -1;
+}
+
+const struct wc_cache_entry* wc_cache_find(const struct wc_cache* c, dev_t dev, ino_t ino) {
+    if (c->len == 0)
+        return NULL;
+
+    struct wc_cache_entry* e = lookup(c, dev, ino);
+    return e->what == 0 ? NULL : e;
+}
+
+int wc_cache_put(struct wc_cache* c, const struct wc_cache_entry* e) {
+    if (hash_full(c->len, c->cap) && grow(c) == -1)
+        return -1;
+
+    struct wc_cache_entry* slot = lookup(c, e->dev, e->ino);
+    if (slot->what == 0)
+        c->len++;
+    *slot = *e;
+    return 0;
+}
+
+void wc_cache_free(struct wc_cache* c) {
+    free(c->slots);
+    memset(c, 0, sizeof(*c));
+}
+
+int wc_cache_sample(int fd, struct wc_cache_entry* e) {
+    return sample(fd, e->cnt.bytes, &e->head, &e->tail);
+}
+
+void wc_cache_times(const struct stat* sb, struct wc_cache_entry* e) {
+    e->mtime = sb->st_mtim;
+    e->ctime = sb->st_ctim;
+}
+
+int wc_cache_valid(int fd, const struct stat* sb, const struct wc_cache_entry* e) {
+    uint64_t head = 0, tail = 0;
+
+    if (sb->st_size < 0 || (uintmax_t)sb->st_size < e->cnt.bytes)
+        return 0; /* truncated */
+
+    // a rewrite keeping the size may leave the windows as they were.
+    if ((uintmax_t)sb->st_size == e->cnt.bytes
+        && (!same_time(&sb->st_mtim, &e->mtime) || !same_time(&sb->st_ctim, &e->ctime)))
+        return 0;
+
+    if (sample(fd, e->cnt.bytes, &head, &tail) == -1)
+        return 0;
+
+    return head == e->head && tail == e->tail;
+}
+
+/*
+ * lookup returns the slot of the (@dev, @ino) entry or the empty slot where
+ * it would be placed. The table must have at least one empty slot.
+ */
+static struct wc_cache_entry* lookup(const struct wc_cache* c, dev_t dev, ino_t ino) {
+    size_t i = hash_slot(hash_inode(dev, ino), c->cap);
+
+    for (;;) {
+        struct wc_cache_entry* e = &c->slots[i];
+        if (e->what == 0 || (e->dev == dev && e->ino == ino))
+            return e;
+        i = hash_next(i, c->cap);
+    }
+}
+
+static int grow(struct wc_cache* c) {
+    struct wc_cache old = *c;
+
+    c->cap = old.cap == 0 ? 64 : old.cap * 2;
+    c->len = 0;
+    if ((c->slots = calloc(c->cap, sizeof(struct wc_cache_entry))) == NULL) {
+        fprintf(stderr, "calloc, no memory\n");
+        *c = old;
+        return -1;
+    }
+
+    for (size_t i = 0; i < old.cap; i++) {
+        if (old.slots[i].what == 0)
+            continue;
+        *lookup(c, old.slots[i].dev, old.slots[i].ino) = old.slots[i];
+        c->len++;
+    }
+
+    free(old.slots);
+    return 0;
+}
+
+static int sample(int fd, uintmax_t bytes, uint64_t* head, uint64_t* tail) {
+    const size_t hlen = bytes < WC_CACHE_WINDOW ? bytes : WC_CACHE_WINDOW;
+
+    if (fnv1a_window(fd, 0, hlen, head) == -1
+        || fnv1a_window(fd, bytes - hlen, hlen, tail) == -1)
+        return -1;
+    return 0;
+}
+
+static int same_time(const struct timespec* a, const struct timespec* b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "counter.h"
+
+/*
+ * wc_cache remembers the counts of files between runs, so a file that only
+ * grew since the last run is counted from the cached state and only the new
+ * tail is read. A file is known by its device and inode numbers. A truncation
+ * is detected by the size, a rewrite of the same size by the modification and
+ * change times. A file that grew has new times anyway, its prefix is checked
+ * by the hashes of two windows only: its first and its last WC_CACHE_WINDOW
+ * bytes, so an edit in the middle of a file that also grew goes unnoticed.
+ */
+enum { WC_CACHE_WINDOW = 4096 };
+
+struct wc_cache_entry {
+    dev_t dev;
+    ino_t ino;
+    unsigned what; /* the metrics @cnt holds, 0 - an empty slot */
+    uint64_t head; /* hash of the first window of the counted prefix */
+    uint64_t tail; /* hash of the last window of the counted prefix */
+    struct timespec mtime; /* the times of the file when it was counted */
+    struct timespec ctime;
+    struct wc_counts cnt;
+};
+
+/* wc_cache is an open addressing hash table of entries */
+struct wc_cache {
+    struct wc_cache_entry* slots;
+    size_t cap;
+    size_t len;
+};
+
+/*
+ * wc_cache_load reads the cache file @path into @c. A missing file is an
+ * empty cache. Returns -1 in case of the error.
+ */
+int wc_cache_load(struct wc_cache* c, const char* path);
+
+/*
+ * wc_cache_save writes @c to @path, the file is replaced atomically. Returns
+ * -1 in case of the error.
+ */
+int wc_cache_save(const struct wc_cache* c, const char* path);
+
+const struct wc_cache_entry* wc_cache_find(const struct wc_cache* c, dev_t dev, ino_t ino);
+int wc_cache_put(struct wc_cache* c, const struct wc_cache_entry* e);
+void wc_cache_free(struct wc_cache* c);
+
+/*
+ * wc_cache_sample hashes the windows of the first @e->cnt.bytes bytes of @fd
+ * into @e. Returns -1 in case of the error.
+ */
+int wc_cache_sample(int fd, struct wc_cache_entry* e);
+
+/*
+ * wc_cache_times copies the modification and change times of @sb into @e.
+ */
+void wc_cache_times(const struct stat* sb, struct wc_cache_entry* e);
+
+/*
+ * wc_cache_valid tells whether @e still describes a prefix of @fd with the
+ * status @sb: the file wasn't truncated, it grew or its times didn't change,
+ * and the sampled windows have the same content.
+ */
+int wc_cache_valid(int fd, const struct stat* sb, const struct wc_cache_entry* e);